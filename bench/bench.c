@@ -0,0 +1,651 @@
+/* needed for wait4, syscall and struct rusage */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include <pgalloc.h>
+
+/*
+ * Runs every benchmark against pgalloc and against the C library malloc and prints one CSV row per run.
+ * Each run happens in a child process of its own, so neither allocator sees the other's heap and the
+ * peak RSS reported is that of the run alone. Pass a scale factor to make every run longer or shorter.
+ *
+ * Every benchmark runs twice. The first run is timed as a whole. The second run splits the work into
+ * batches of allocations and batches of frees and measures each batch on its own, with hardware counters
+ * from perf_event_open() where the kernel and the machine provide them. Counter columns are left empty
+ * for counters that cannot be opened.
+ */
+
+#define SINGLE_OPS      (4 * 1000 * 1000)
+#define SINGLE_BATCH    256
+#define CHURN_OPS       (4 * 1000 * 1000)
+#define CHURN_SLOTS     8192
+#define CHURN_BATCH     256
+#define CHURN_LARGE     64              // one request in CHURN_LARGE is larger than a page
+#define ORDER_BATCH     10000
+#define ORDER_ROUNDS    200
+#define QUEUE_LEN       1024
+#define QUEUE_ITEMS     (2 * 1000 * 1000)
+#define QUEUE_BATCH     64
+#define PAIRS           4
+
+#define PHASE_ALLOC     0
+#define PHASE_FREE      1
+#define PHASES          2
+#define COUNTERS        6
+
+typedef struct Allocator Allocator;
+typedef struct Phase Phase;
+typedef struct Result Result;
+typedef struct Meter Meter;
+typedef struct Benchmark Benchmark;
+typedef struct Queue Queue;
+
+struct Allocator {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*free)(void *);
+};
+
+/*
+ * Time and counters spent in one kind of call, see Meter.
+ */
+struct Phase {
+    unsigned long long ops;
+    double seconds;
+    uint64_t value[COUNTERS];
+    uint64_t enabled[COUNTERS];     // time the counter was enabled and running, to scale multiplexed counters
+    uint64_t running[COUNTERS];
+};
+
+struct Result {
+    unsigned long long ops;         // calls to alloc or free in the timed run
+    double seconds;
+    Phase phases[PHASES];           // the measured run
+    unsigned int counters;          // bit set for every counter that could be opened
+};
+
+/*
+ * Measures batches of calls for one thread. A Meter that is not on measures nothing.
+ */
+struct Meter {
+    int on;
+    int fd[COUNTERS];
+    uint64_t last[COUNTERS][3];     // value, time enabled and time running at the end of the last batch
+    double started;
+    Phase *phase;
+};
+
+struct Benchmark {
+    const char *name;
+    size_t size;                // block size, or the largest block size for mixed sizes
+    unsigned int threads;
+    void (*run)(const Allocator *, size_t, unsigned long, int, Result *);
+};
+
+/*
+ * Single producer, single consumer ring of blocks.
+ */
+struct Queue {
+    const Allocator *allocator;
+    size_t size;
+    unsigned long items;
+    int metered;
+    Phase phases[PHASES];
+    unsigned int counters;
+    _Atomic(unsigned long) head;
+    _Atomic(unsigned long) tail;
+    void *slots[QUEUE_LEN];
+};
+
+static void benchSingle(const Allocator *, size_t, unsigned long, int, Result *);
+static void benchChurn(const Allocator *, size_t, unsigned long, int, Result *);
+static void benchLifo(const Allocator *, size_t, unsigned long, int, Result *);
+static void benchFifo(const Allocator *, size_t, unsigned long, int, Result *);
+static void benchProducerConsumer(const Allocator *, size_t, unsigned long, int, Result *);
+
+static const Allocator allocators[] = {
+    { "pgalloc", pgalloc, pgfree },
+    { "malloc", malloc, free },
+};
+
+static const Benchmark benchmarks[] = {
+    { "single", 16, 1, benchSingle },
+    { "single", 64, 1, benchSingle },
+    { "single", 256, 1, benchSingle },
+    { "single", 1024, 1, benchSingle },
+    { "single", 4096, 1, benchSingle },
+    { "churn", 8192, 1, benchChurn },
+    { "lifo", 64, 1, benchLifo },
+    { "lifo", 512, 1, benchLifo },
+    { "fifo", 64, 1, benchFifo },
+    { "fifo", 512, 1, benchFifo },
+    { "producer_consumer", 64, 2 * PAIRS, benchProducerConsumer },
+    { "producer_consumer", 1024, 2 * PAIRS, benchProducerConsumer },
+};
+
+static const char *phaseNames[PHASES] = { "alloc", "free" };
+
+/*
+ * Counters collected for every phase, user space only.
+ */
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "dtlb_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/* keeps the compiler from dropping blocks that are never read */
+static volatile unsigned char sink;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static uint64_t nextRandom(uint64_t *state)
+{
+    // xorshift64, the same sequence for every allocator
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static void touch(void *block, size_t size)
+{
+    unsigned char *bytes = block;
+
+    bytes[0] = (unsigned char)size;
+    bytes[size - 1] = (unsigned char)size;
+    sink = bytes[0];
+}
+
+static int openCounter(unsigned int i)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // counts the calling thread only, on any cpu
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void meterOpen(Meter *m, int on)
+{
+    memset(m, 0, sizeof(*m));
+    m->on = on;
+
+    for (unsigned int i = 0; i < COUNTERS; i++) {
+        m->fd[i] = on ? openCounter(i) : -1;
+    }
+}
+
+static void meterClose(Meter *m, unsigned int *opened)
+{
+    for (unsigned int i = 0; i < COUNTERS; i++) {
+        if (m->fd[i] >= 0) {
+            *opened |= 1U << i;
+            close(m->fd[i]);
+        }
+    }
+}
+
+static void phaseStart(Meter *m, Phase *phase)
+{
+    if (!m->on) {
+        return;
+    }
+
+    m->phase = phase;
+
+    // enables every counter this thread opened
+    prctl(PR_TASK_PERF_EVENTS_ENABLE, 0, 0, 0, 0);
+    m->started = now();
+}
+
+static void phaseStop(Meter *m, unsigned long ops)
+{
+    if (!m->on) {
+        return;
+    }
+
+    double stopped = now();
+    prctl(PR_TASK_PERF_EVENTS_DISABLE, 0, 0, 0, 0);
+
+    Phase *phase = m->phase;
+
+    phase->ops += ops;
+    phase->seconds += stopped - m->started;
+
+    for (unsigned int i = 0; i < COUNTERS; i++) {
+        uint64_t values[3];
+
+        if (m->fd[i] < 0 || read(m->fd[i], values, sizeof(values)) != sizeof(values)) {
+            continue;
+        }
+
+        phase->value[i] += values[0] - m->last[i][0];
+        phase->enabled[i] += values[1] - m->last[i][1];
+        phase->running[i] += values[2] - m->last[i][2];
+        memcpy(m->last[i], values, sizeof(values));
+    }
+}
+
+static void addPhases(Phase *to, const Phase *from)
+{
+    for (unsigned int p = 0; p < PHASES; p++) {
+        to[p].ops += from[p].ops;
+        to[p].seconds += from[p].seconds;
+
+        for (unsigned int i = 0; i < COUNTERS; i++) {
+            to[p].value[i] += from[p].value[i];
+            to[p].enabled[i] += from[p].enabled[i];
+            to[p].running[i] += from[p].running[i];
+        }
+    }
+}
+
+/*
+ * The timed run allocates and frees one block at a time, the measured run SINGLE_BATCH at a time.
+ */
+static void benchSingle(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result)
+{
+    static void *blocks[SINGLE_BATCH];
+    unsigned int batch = metered ? SINGLE_BATCH : 1;
+    unsigned long ops = SINGLE_OPS * scale;
+    Meter m;
+
+    meterOpen(&m, metered);
+    double start = now();
+
+    for (unsigned long i = 0; i < ops; i += batch) {
+        phaseStart(&m, &result->phases[PHASE_ALLOC]);
+        for (unsigned int k = 0; k < batch; k++) {
+            blocks[k] = a->alloc(size);
+            touch(blocks[k], size);
+        }
+        phaseStop(&m, batch);
+
+        phaseStart(&m, &result->phases[PHASE_FREE]);
+        for (unsigned int k = batch; k > 0; k--) {
+            a->free(blocks[k - 1]);
+        }
+        phaseStop(&m, batch);
+    }
+
+    result->ops = 2ULL * ops;
+    result->seconds = now() - start;
+    meterClose(&m, &result->counters);
+}
+
+static size_t churnSize(uint64_t r, size_t size)
+{
+    if (((r >> 16) % CHURN_LARGE) == 0) {
+        return size + 1 + ((r >> 24) % (8 * size));
+    }
+
+    // skewed towards small blocks like most programs
+    size_t bytes = 1 + ((r >> 24) % ((size_t)8 << ((r >> 40) % 11)));
+
+    return bytes > size ? size : bytes;
+}
+
+/*
+ * The timed run replaces one random block at a time, the measured run CHURN_BATCH at a time.
+ */
+static void benchChurn(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result)
+{
+    static void *slots[CHURN_SLOTS];
+    uint64_t picks[CHURN_BATCH];
+    unsigned int batch = metered ? CHURN_BATCH : 1;
+    unsigned long ops = CHURN_OPS * scale;
+    unsigned long long calls = 0;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    Meter m;
+
+    meterOpen(&m, metered);
+    double start = now();
+
+    for (unsigned long i = 0; i < ops; i += batch) {
+        unsigned long freed = 0;
+
+        for (unsigned int k = 0; k < batch; k++) {
+            picks[k] = nextRandom(&state);
+        }
+
+        phaseStart(&m, &result->phases[PHASE_FREE]);
+        for (unsigned int k = 0; k < batch; k++) {
+            unsigned int slot = (unsigned int)(picks[k] % CHURN_SLOTS);
+
+            if (slots[slot]) {
+                a->free(slots[slot]);
+                slots[slot] = NULL;
+                freed++;
+            }
+        }
+        phaseStop(&m, freed);
+
+        phaseStart(&m, &result->phases[PHASE_ALLOC]);
+        for (unsigned int k = 0; k < batch; k++) {
+            unsigned int slot = (unsigned int)(picks[k] % CHURN_SLOTS);
+            size_t bytes = churnSize(picks[k], size);
+
+            if (!slots[slot]) {
+                slots[slot] = a->alloc(bytes);
+                touch(slots[slot], bytes);
+                calls++;
+            }
+        }
+        phaseStop(&m, batch);
+
+        calls += freed;
+    }
+
+    phaseStart(&m, &result->phases[PHASE_FREE]);
+    unsigned long freed = 0;
+    for (unsigned int i = 0; i < CHURN_SLOTS; i++) {
+        if (slots[i]) {
+            a->free(slots[i]);
+            slots[i] = NULL;
+            freed++;
+        }
+    }
+    phaseStop(&m, freed);
+
+    result->ops = calls + freed;
+    result->seconds = now() - start;
+    meterClose(&m, &result->counters);
+}
+
+static void benchOrder(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result, int lifo)
+{
+    static void *blocks[ORDER_BATCH];
+    unsigned long rounds = ORDER_ROUNDS * scale;
+    Meter m;
+
+    meterOpen(&m, metered);
+    double start = now();
+
+    for (unsigned long round = 0; round < rounds; round++) {
+        phaseStart(&m, &result->phases[PHASE_ALLOC]);
+        for (unsigned int i = 0; i < ORDER_BATCH; i++) {
+            blocks[i] = a->alloc(size);
+            touch(blocks[i], size);
+        }
+        phaseStop(&m, ORDER_BATCH);
+
+        phaseStart(&m, &result->phases[PHASE_FREE]);
+        for (unsigned int i = 0; i < ORDER_BATCH; i++) {
+            a->free(blocks[lifo ? ORDER_BATCH - 1 - i : i]);
+        }
+        phaseStop(&m, ORDER_BATCH);
+    }
+
+    result->ops = 2ULL * ORDER_BATCH * rounds;
+    result->seconds = now() - start;
+    meterClose(&m, &result->counters);
+}
+
+static void benchLifo(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result)
+{
+    benchOrder(a, size, scale, metered, result, 1);
+}
+
+static void benchFifo(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result)
+{
+    benchOrder(a, size, scale, metered, result, 0);
+}
+
+/*
+ * Producers only allocate and consumers only free. The timed run passes one block at a time,
+ * the measured run QUEUE_BATCH at a time.
+ */
+static void *produce(void *arg)
+{
+    Queue *q = arg;
+    void *blocks[QUEUE_BATCH];
+    unsigned int batch = q->metered ? QUEUE_BATCH : 1;
+    Meter m;
+
+    meterOpen(&m, q->metered);
+
+    for (unsigned long i = 0; i < q->items; i += batch) {
+        phaseStart(&m, &(q->phases[PHASE_ALLOC]));
+        for (unsigned int k = 0; k < batch; k++) {
+            blocks[k] = q->allocator->alloc(q->size);
+            touch(blocks[k], q->size);
+        }
+        phaseStop(&m, batch);
+
+        for (unsigned int k = 0; k < batch; k++) {
+            unsigned long head = atomic_load_explicit(&(q->head), memory_order_relaxed);
+
+            while (head - atomic_load_explicit(&(q->tail), memory_order_acquire) == QUEUE_LEN) {
+                sched_yield();
+            }
+
+            q->slots[head % QUEUE_LEN] = blocks[k];
+            atomic_store_explicit(&(q->head), head + 1, memory_order_release);
+        }
+    }
+
+    meterClose(&m, &(q->counters));
+    return NULL;
+}
+
+static void *consume(void *arg)
+{
+    Queue *q = arg;
+    void *blocks[QUEUE_BATCH];
+    unsigned int batch = q->metered ? QUEUE_BATCH : 1;
+    Meter m;
+
+    meterOpen(&m, q->metered);
+
+    for (unsigned long i = 0; i < q->items; i += batch) {
+        for (unsigned int k = 0; k < batch; k++) {
+            unsigned long tail = atomic_load_explicit(&(q->tail), memory_order_relaxed);
+
+            while (atomic_load_explicit(&(q->head), memory_order_acquire) == tail) {
+                sched_yield();
+            }
+
+            blocks[k] = q->slots[tail % QUEUE_LEN];
+            atomic_store_explicit(&(q->tail), tail + 1, memory_order_release);
+        }
+
+        phaseStart(&m, &(q->phases[PHASE_FREE]));
+        for (unsigned int k = 0; k < batch; k++) {
+            q->allocator->free(blocks[k]);
+        }
+        phaseStop(&m, batch);
+    }
+
+    meterClose(&m, &(q->counters));
+    return NULL;
+}
+
+static void benchProducerConsumer(const Allocator *a, size_t size, unsigned long scale, int metered, Result *result)
+{
+    static Queue queues[PAIRS];
+    pthread_t threads[2 * PAIRS];
+
+    memset(queues, 0, sizeof(queues));
+    double start = now();
+
+    for (unsigned int i = 0; i < PAIRS; i++) {
+        queues[i].allocator = a;
+        queues[i].size = size;
+        queues[i].items = QUEUE_ITEMS * scale;
+        queues[i].metered = metered;
+        pthread_create(&threads[2 * i], NULL, produce, &queues[i]);
+        pthread_create(&threads[(2 * i) + 1], NULL, consume, &queues[i]);
+    }
+
+    for (unsigned int i = 0; i < 2 * PAIRS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    result->ops = 2ULL * PAIRS * QUEUE_ITEMS * scale;
+    result->seconds = now() - start;
+
+    for (unsigned int i = 0; i < PAIRS; i++) {
+        addPhases(result->phases, queues[i].phases);
+        result->counters |= queues[i].counters;
+    }
+}
+
+static void printPhase(const Phase *phase, unsigned int opened)
+{
+    printf(",%.2f", phase->ops ? (phase->seconds * 1e9) / (double)phase->ops : 0.0);
+
+    for (unsigned int i = 0; i < COUNTERS; i++) {
+        if (!(opened & (1U << i)) || phase->ops == 0 || phase->running[i] == 0) {
+            // not available on this machine, or never scheduled
+            printf(",");
+            continue;
+        }
+
+        // scale up counters that had to share the PMU with others
+        double value = (double)phase->value[i] * ((double)phase->enabled[i] / (double)phase->running[i]);
+
+        printf(",%.3f", value / (double)phase->ops);
+    }
+}
+
+/*
+ * Run the specified benchmark in a child process and print its row. Returns 0 on success.
+ */
+static int runBenchmark(const Benchmark *b, const Allocator *a, unsigned long scale)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        static Result result;
+        Result timed = { 0 };
+
+        b->run(a, b->size, scale, 0, &timed);
+        b->run(a, b->size, scale, 1, &result);
+        result.ops = timed.ops;
+        result.seconds = timed.seconds;
+
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    static Result result;
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    struct rusage usage;
+    int status = 0;
+
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) || got != sizeof(result)) {
+        fprintf(stderr, "%s/%s failed\n", b->name, a->name);
+        return -1;
+    }
+
+    printf("%s,%s,%zu,%u,%llu,%.2f,%.2f,%ld", b->name, a->name, b->size, b->threads, result.ops,
+            (result.seconds * 1e9) / (double)result.ops, ((double)result.ops / result.seconds) / 1e6, usage.ru_maxrss);
+
+    for (unsigned int p = 0; p < PHASES; p++) {
+        printPhase(&result.phases[p], result.counters);
+    }
+    printf("\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long scale = 1;
+    int failed = 0;
+
+    if (argc > 1) {
+        scale = strtoul(argv[1], NULL, 10);
+        if (scale == 0) {
+            fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int probe = openCounter(0);
+
+    if (probe < 0) {
+        fprintf(stderr, "hardware counters unavailable (%s), counter columns are left empty\n", strerror(errno));
+    } else {
+        close(probe);
+    }
+
+    printf("benchmark,allocator,size,threads,ops,ns_per_op,mops_per_sec,peak_rss_kib");
+    for (unsigned int p = 0; p < PHASES; p++) {
+        printf(",%s_ns_per_op", phaseNames[p]);
+        for (unsigned int i = 0; i < COUNTERS; i++) {
+            printf(",%s_%s_per_op", phaseNames[p], counters[i].name);
+        }
+    }
+    printf("\n");
+
+    for (unsigned int i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        for (unsigned int j = 0; j < sizeof(allocators) / sizeof(allocators[0]); j++) {
+            if (runBenchmark(&benchmarks[i], &allocators[j], scale)) {
+                failed = 1;
+            }
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,487 @@
+/* needed for wait4 and struct rusage */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <pgalloc.h>
+
+/*
+ * Replays a trace recorded by a build of pgalloc with PG_TRACE, see pgtrace(), against pgalloc and against the C library
+ * malloc and prints one CSV row for each. Every replay happens in a child process of its own, like the benchmarks.
+ *
+ * The records of every thread are replayed in the order they were recorded by a single thread, as fast as possible.
+ * Before any child starts, the trace is mapped and turned into a list of operations on numbered blocks, so a replay does
+ * nothing but walk that list and call the allocator. The time of the same walk with an allocator that does nothing is
+ * taken off, which leaves ns per call to the allocator alone.
+ * A row reports ns per call, peak RSS, the most bytes the trace ever had live and how much the resident set had grown
+ * past its size before the replay at that moment; the overhead is how far that growth exceeds the live bytes.
+ * Blocks freed in the trace but allocated before it started are skipped.
+ */
+
+typedef struct Allocator Allocator;
+typedef struct Slot Slot;
+typedef struct Table Table;
+typedef struct Op Op;
+typedef struct Trace Trace;
+typedef struct Result Result;
+
+struct Allocator {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*free)(void *);
+};
+
+/*
+ * Live block of the trace, found by its address in the trace.
+ */
+struct Slot {
+    uint64_t ptr;               // address in the trace, 0 for an empty slot
+    uint64_t size;
+    uint32_t block;             // number of the block in the replay
+};
+
+/*
+ * Open addressing table of live blocks with linear probing, mapped directly so neither allocator pays for it.
+ */
+struct Table {
+    Slot *slots;
+    size_t mask;                // slots - 1, slots is a power of 2
+    size_t count;
+};
+
+/*
+ * One call of a replay. Blocks are numbered so that a replay keeps them in a plain array, and a number is reused once
+ * its block is freed, so the array never holds more than the most blocks live at once.
+ */
+struct Op {
+    uint64_t size;              // bytes to allocate, 0 for a free
+    uint32_t block;
+    uint32_t op;                // PG_TRACE_ALLOC or PG_TRACE_FREE
+};
+
+/*
+ * What the trace turns into before it is replayed.
+ */
+struct Trace {
+    size_t records;
+    uint32_t threads;
+    Op *ops;
+    size_t numOps;
+    uint32_t blocks;            // most blocks live at once
+    uint64_t peakLive;          // most bytes live at once
+    size_t peakOp;              // op after which peakLive is reached
+};
+
+struct Result {
+    size_t calls;
+    double seconds;
+    long baseRss;               // resident KiB before the replay
+    long peakUsed;              // resident KiB the replay added by the time the live bytes peaked
+};
+
+static void *nullAlloc(size_t);
+static void nullFree(void *);
+
+static const Allocator allocators[] = {
+    { "pgalloc", pgalloc, pgfree },
+    { "malloc", malloc, free },
+};
+
+/* does nothing, so a replay with it times the replay alone */
+static const Allocator dry = { "dry", nullAlloc, nullFree };
+
+/* keeps the compiler from dropping blocks that are never read */
+static volatile unsigned char sink;
+
+static void *nullAlloc(size_t bytes)
+{
+    (void)bytes;
+    return NULL;
+}
+
+static void nullFree(void *ptr)
+{
+    (void)ptr;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static void touch(void *block, uint64_t size)
+{
+    unsigned char *bytes = block;
+
+    if (!bytes || size == 0) {
+        return;
+    }
+
+    bytes[0] = (unsigned char)size;
+    bytes[size - 1] = (unsigned char)size;
+    sink = bytes[0];
+}
+
+/*
+ * Return the specified bytes of zero filled memory mapped directly, or NULL on error.
+ */
+static void *mapZero(size_t bytes)
+{
+    void *mem = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+/*
+ * Return the resident set of this process in KiB, or 0 if it cannot be read.
+ */
+static long residentKib(void)
+{
+    char buf[128];
+    long pages = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    ssize_t got = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (got <= 0) {
+        return 0;
+    }
+
+    buf[got] = '\0';
+    if (sscanf(buf, "%*s %ld", &pages) != 1) {
+        return 0;
+    }
+
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int tableInit(Table *t, size_t live)
+{
+    size_t slots = 16;
+
+    while (slots < 2 * live) {
+        slots *= 2;
+    }
+
+    t->slots = mapZero(slots * sizeof(Slot));
+    if (!t->slots) {
+        return -1;
+    }
+
+    t->mask = slots - 1;
+    t->count = 0;
+
+    return 0;
+}
+
+static void tableFree(Table *t)
+{
+    munmap(t->slots, (t->mask + 1) * sizeof(Slot));
+}
+
+/*
+ * Return the slot holding the specified address, or the empty slot where it would go.
+ */
+static Slot *tableFind(Table *t, uint64_t ptr)
+{
+    // Fibonacci hashing spreads addresses that differ only in their upper bits
+    size_t i = (size_t)((ptr * UINT64_C(0x9e3779b97f4a7c15)) >> 20) & t->mask;
+
+    while (t->slots[i].ptr && t->slots[i].ptr != ptr) {
+        i = (i + 1) & t->mask;
+    }
+
+    return &t->slots[i];
+}
+
+/*
+ * Add the specified slot, which must be empty, growing the table first if needed. Returns the slot or NULL on error.
+ */
+static Slot *tableAdd(Table *t, uint64_t ptr)
+{
+    if (2 * (t->count + 1) > t->mask + 1) {
+        Table bigger;
+
+        if (tableInit(&bigger, t->count + 1)) {
+            return NULL;
+        }
+
+        for (size_t i = 0; i <= t->mask; i++) {
+            if (t->slots[i].ptr) {
+                *tableFind(&bigger, t->slots[i].ptr) = t->slots[i];
+                bigger.count++;
+            }
+        }
+
+        tableFree(t);
+        *t = bigger;
+    }
+
+    Slot *slot = tableFind(t, ptr);
+
+    slot->ptr = ptr;
+    t->count++;
+
+    return slot;
+}
+
+/*
+ * Empty the specified slot, moving later slots of its probe sequence back so no lookup stops short.
+ */
+static void tableRemove(Table *t, Slot *slot)
+{
+    size_t hole = (size_t)(slot - t->slots);
+    size_t i = hole;
+
+    for (;;) {
+        i = (i + 1) & t->mask;
+        if (!t->slots[i].ptr) {
+            break;
+        }
+
+        size_t home = (size_t)((t->slots[i].ptr * UINT64_C(0x9e3779b97f4a7c15)) >> 20) & t->mask;
+
+        // the entry may fill the hole unless its home lies cyclically after the hole and up to i
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+
+    t->slots[hole].ptr = 0;
+    t->count--;
+}
+
+/*
+ * Map the trace at the specified path and turn its records into trace->ops. Returns 0 on success.
+ */
+static int loadTrace(const char *path, Trace *trace)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+
+    // a trace is whole records, a record cut short by a program that died is left out
+    trace->records = (size_t)st.st_size / sizeof(PgTraceRecord);
+
+    const PgTraceRecord *records = NULL;
+
+    if (trace->records) {
+        void *mem = mmap(NULL, trace->records * sizeof(PgTraceRecord), PROT_READ, MAP_PRIVATE, fd, 0);
+
+        records = mem == MAP_FAILED ? NULL : mem;
+    }
+    close(fd);
+
+    // a record turns into a free, an allocation or both, and numbers freed are reused last in first out
+    Table table;
+    uint32_t *freeBlocks = mapZero(trace->records * sizeof(uint32_t));
+    size_t freeCount = 0;
+    uint64_t live = 0;
+
+    trace->ops = mapZero(2 * trace->records * sizeof(Op));
+    if ((trace->records && !records) || !freeBlocks || !trace->ops || tableInit(&table, 0)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < trace->records; i++) {
+        const PgTraceRecord *r = &records[i];
+        Slot *slot = tableFind(&table, r->ptr);
+
+        if (r->thread > trace->threads) {
+            trace->threads = r->thread;
+        }
+
+        if (slot->ptr) {
+            // freed, or allocated again without a free the trace missed
+            trace->ops[trace->numOps++] = (Op){ .size = 0, .block = slot->block, .op = PG_TRACE_FREE };
+            freeBlocks[freeCount++] = slot->block;
+            live -= slot->size;
+            tableRemove(&table, slot);
+        }
+
+        if (r->op != PG_TRACE_ALLOC) {
+            continue;
+        }
+
+        slot = tableAdd(&table, r->ptr);
+        if (!slot) {
+            return -1;
+        }
+
+        slot->size = r->size;
+        slot->block = freeCount ? freeBlocks[--freeCount] : trace->blocks++;
+        trace->ops[trace->numOps++] = (Op){ .size = r->size, .block = slot->block, .op = PG_TRACE_ALLOC };
+
+        live += r->size;
+        if (live > trace->peakLive) {
+            trace->peakLive = live;
+            trace->peakOp = trace->numOps - 1;
+        }
+    }
+
+    tableFree(&table);
+    munmap(freeBlocks, trace->records * sizeof(uint32_t));
+    if (records) {
+        munmap((void *)records, trace->records * sizeof(PgTraceRecord));
+    }
+
+    return 0;
+}
+
+/*
+ * Run the specified ops of the trace with the specified allocator and return the seconds they took.
+ */
+static double runOps(const Allocator *a, const Trace *trace, void **blocks, size_t from, size_t to)
+{
+    double start = now();
+
+    for (size_t i = from; i < to; i++) {
+        const Op *op = &trace->ops[i];
+
+        if (op->op == PG_TRACE_FREE) {
+            a->free(blocks[op->block]);
+        } else {
+            blocks[op->block] = a->alloc(op->size);
+            touch(blocks[op->block], op->size);
+        }
+    }
+
+    return now() - start;
+}
+
+/*
+ * Replay the whole trace with the specified allocator into the specified result, reading the resident set where the
+ * live bytes peak with the clock stopped. Returns 0 on success.
+ */
+static int replay(const Allocator *a, const Trace *trace, Result *result)
+{
+    void **blocks = mapZero(trace->blocks * sizeof(void *));
+    size_t split = trace->numOps ? trace->peakOp + 1 : 0;
+
+    if (!blocks) {
+        return -1;
+    }
+
+    result->calls = trace->numOps;
+    result->baseRss = residentKib();
+    result->seconds = runOps(a, trace, blocks, 0, split);
+    result->peakUsed = residentKib() - result->baseRss;
+    result->seconds += runOps(a, trace, blocks, split, trace->numOps);
+
+    munmap(blocks, trace->blocks * sizeof(void *));
+
+    return 0;
+}
+
+/*
+ * Replay the specified trace in a child process and print its row. Returns 0 on success.
+ */
+static int runReplay(const Trace *trace, const Allocator *a)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        static Result result;
+        static Result dryResult;
+
+        // the dry run goes first, so the replay does not leave it a warmer cache than it had itself
+        if (replay(&dry, trace, &dryResult) || replay(a, trace, &result)) {
+            _exit(1);
+        }
+
+        result.seconds -= dryResult.seconds;
+
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    static Result result;
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    struct rusage usage;
+    int status = 0;
+
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) || got != sizeof(result)) {
+        fprintf(stderr, "replay/%s failed\n", a->name);
+        return -1;
+    }
+
+    long live = (long)(trace->peakLive / 1024);
+    double seconds = result.seconds > 0 ? result.seconds : 0.0;
+
+    printf("%s,%zu,%u,%zu,%.2f,%ld,%ld,%ld,%.1f\n", a->name, trace->records, trace->threads, result.calls,
+            result.calls ? (seconds * 1e9) / (double)result.calls : 0.0, usage.ru_maxrss, live, result.peakUsed,
+            live ? (100.0 * (double)(result.peakUsed - live)) / (double)live : 0.0);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static Trace trace;
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace\n", argv[0]);
+        return 2;
+    }
+
+    if (loadTrace(argv[1], &trace)) {
+        fprintf(stderr, "%s: cannot read %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 1;
+    }
+
+    printf("allocator,records,threads,calls,ns_per_call,peak_rss_kib,peak_live_kib,used_at_peak_kib,overhead_pct\n");
+
+    for (unsigned int j = 0; j < sizeof(allocators) / sizeof(allocators[0]); j++) {
+        if (runReplay(&trace, &allocators[j])) {
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -7,27 +7,375 @@
 #define PGALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct PageHeader PageHeader;
+typedef struct PgArena PgArena;
+typedef struct PgCache PgCache;
+typedef struct PgFile PgFile;
+
+/*
+ * Most size classes pgstats() can report.
+ */
+#define PG_STATS_CLASSES 64
+#define PG_STATS_NODES   64
+
+/*
+ * Statistics for one size class, summed over every thread, see pgstats().
+ */
+typedef struct PgClassStats {
+    unsigned int blockSize;     // block size of this class
+    size_t pages;               // pages holding blocks of this class, including empty pages kept for reuse
+    size_t fullPages;           // pages with no block left to allocate
+    size_t usedBlocks;          // blocks allocated and not yet freed
+    size_t reservedBytes;       // bytes taken by the pages of this class
+    uint64_t requestedBytes;    // bytes requested by every allocation so far
+    uint64_t allocatedBytes;    // bytes handed out by every allocation so far, the difference to requestedBytes is lost to rounding
+    uint64_t allocs;            // blocks allocated so far
+    uint64_t frees;             // blocks freed so far
+    uint64_t newPages;          // pages created so far
+} PgClassStats;
+
+/*
+ * Statistics for the chunks of one NUMA node, see pgstats() and pgnode().
+ */
+typedef struct PgNodeStats {
+    size_t chunks;              // chunks mapped for this node
+    size_t usedPages;           // pages of those chunks holding blocks, arenas or caches
+    size_t freePages;           // pages of those chunks free for reuse
+} PgNodeStats;
+
+/*
+ * Statistics for the whole allocator, see pgstats().
+ */
+typedef struct PgStats {
+    unsigned int classes;       // number of entries used in sizeClass
+    PgClassStats sizeClass[PG_STATS_CLASSES];
+    size_t largeSpans;          // large blocks allocated and not yet freed
+    size_t largeBytes;          // bytes mapped for those blocks
+    size_t cachedSpans;         // freed large spans kept for reuse
+    size_t cachedBytes;         // bytes mapped for those spans
+    uint64_t largeAllocs;       // large blocks allocated so far
+    uint64_t largeFrees;        // large blocks freed so far
+    unsigned int nodes;         // number of entries used in node, the NUMA nodes of the machine or any node chunks were taken for
+    PgNodeStats node[PG_STATS_NODES];
+} PgStats;
 
 /*
  * Returns a pointer to a memory block large enough to hold the requested bytes or NULL on error.
+ * Blocks are aligned on 16 bytes, or on the largest power of 2 not above the request for requests smaller than that.
  * All pointers returned by pgalloc() must be freed by pgfree(), calling stdlib free() on pointers
  * is undefined and may corrupt memory.
+ * Each thread allocates from its own pages, so concurrent calls need no external locking.
+ * Requests too large for a page are mapped directly from the OS and freed spans are cached for reuse.
  */
 void *pgalloc(size_t);
 
+/*
+ * Returns a pointer to a memory block large enough to hold the requested bytes aligned on the specified alignment
+ * or NULL on error. The alignment must be a power of 2 no larger than 1 MiB. Blocks aligned on up to a page
+ * are taken from size classes that are a multiple of the alignment, so blocks aligned on 64 bytes never share a cache line.
+ * The block is freed by pgfree().
+ */
+void *pgalloc_aligned(size_t, size_t);
+
 /*
  * Frees pointers returned by pgalloc(). If the specified pointer is NULL, no action is taken.
  * It is a grave error to call pgfree() on pointers not allocated by pgalloc().
+ * Pointers may be freed by any thread. Blocks freed by a thread other than the one that allocated them
+ * are handed back without locking and reclaimed by the allocating thread on its next call to pgalloc().
  */
 void pgfree(void *);
 
 /*
- * Generate a diagnostic print out of all pages managed by pgalloc on STDOUT.
+ * Allocate the specified number of blocks large enough to hold the requested bytes into the specified array.
+ * Blocks are taken from each page in one pass, free blocks first, so this is cheaper than as many calls to pgalloc().
+ * Returns the number of blocks allocated, which is less than the number requested only when memory runs out;
+ * the blocks that were allocated are still valid and must be freed.
+ */
+size_t pgalloc_bulk(size_t, size_t, void **);
+
+/*
+ * Frees the specified number of pointers from the specified array like as many calls to pgfree(). NULL pointers are skipped.
+ * Blocks of the same page are handed back together, so each page is updated once for all of them
+ * rather than once per block. Freeing pointers in the order pgalloc_bulk() returned them groups them best.
+ */
+void pgfree_bulk(void **, size_t);
+
+/*
+ * Returns a new arena or NULL on error. An arena hands out blocks by bumping a pointer through pages taken
+ * from the same chunks as pgalloc() and frees them all at once, see pgarena_reset().
+ * An arena is not thread safe, each arena must only be used by one thread at a time.
+ */
+PgArena *pgarena_create(void);
+
+/*
+ * Returns a pointer to a memory block in the specified arena large enough to hold the requested bytes or NULL on error.
+ * Blocks are aligned on 16 bytes and live until the arena is reset or destroyed.
+ * It is a grave error to pass them to pgfree() or pgrealloc().
+ */
+void *pgarena_alloc(PgArena *, size_t);
+
+/*
+ * Frees every block of the specified arena at once, returning all of its pages but the first without looking at a single block.
+ * The arena may be used again right away.
+ */
+void pgarena_reset(PgArena *);
+
+/*
+ * Frees every block of the specified arena and the arena itself. If the specified arena is NULL, no action is taken.
+ */
+void pgarena_destroy(PgArena *);
+
+/*
+ * Returns a new cache of objects of the specified size aligned on the specified alignment or NULL on error.
+ * The alignment must be a power of 2 no larger than 8 KiB, 0 aligns objects like pgalloc(). Objects must fit in a page.
+ * A cache keeps pages of its own, so its objects never share a page with other allocations.
+ * If a constructor is given it runs once on every object the first time it is handed out, and objects keep their
+ * constructed state while they sit freed in the cache. If a destructor is given it runs on every constructed object
+ * when its page goes back to the chunks. Neither may call into the same cache.
+ * A cache may be used by any number of threads at once.
+ */
+PgCache *pgcache_create(size_t, size_t, void (*)(void *), void (*)(void *));
+
+/*
+ * Returns an object from the specified cache or NULL on error. Objects are freed by pgcache_free(), or by pgfree(),
+ * which finds their cache, but never by pgfree_bulk().
+ */
+void *pgcache_alloc(PgCache *);
+
+/*
+ * Returns the specified object to the specified cache without destroying it. If the specified object is NULL, no action is taken.
+ */
+void pgcache_free(PgCache *, void *);
+
+/*
+ * Make sure at least the specified number of objects can be allocated from the specified cache without taking new pages,
+ * and keep that many pages for the cache once they are empty. Returns nonzero on success, 0 if memory ran out.
+ */
+int pgcache_reserve(PgCache *, size_t);
+
+/*
+ * Destroys every object of the specified cache and the cache itself. Every object must have been freed.
+ * If the specified cache is NULL, no action is taken.
+ */
+void pgcache_destroy(PgCache *);
+
+/*
+ * Address and size of a file heap must be multiples of PG_FILE_ALIGN, see pgfile_open().
+ */
+#define PG_FILE_ALIGN (2 * 1024 * 1024)
+
+/*
+ * Opens the persistent heap kept in the file at the specified path, mapped at the specified address with the specified size,
+ * or NULL on error. A missing or empty file is created with that size. An existing file must have been created with the same
+ * address and size by a build of pgalloc with the same page layout, and must have been synced or closed after it last changed;
+ * otherwise its blocks cannot be trusted and NULL is returned. Reopening only maps the file, so blocks kept in it are found
+ * again through pgfile_root() without being rebuilt.
+ */
+PgFile *pgfile_open(const char *, void *, size_t);
+
+/*
+ * Returns a block of the specified size from the specified file heap or NULL if the file is full or the size does not fit in a page.
+ * A file heap may be used by any number of threads at once, but by one process at a time.
+ */
+void *pgfile_alloc(PgFile *, size_t);
+
+/*
+ * Returns the specified block to the specified file heap. pgfree() and pgfree_bulk() also accept blocks of a file heap
+ * and free them the same way, clearing the consistent mark of the file before it changes.
+ */
+void pgfile_free(PgFile *, void *);
+
+/*
+ * Returns the root block of the specified file heap, NULL until one is set with pgfile_set_root().
+ */
+void *pgfile_root(PgFile *);
+
+/*
+ * Sets the root block of the specified file heap, from which a process reopening the file finds everything else.
+ */
+void pgfile_set_root(PgFile *, void *);
+
+/*
+ * Writes the specified file heap, its blocks and the allocator's bookkeeping for them, back to the file and marks it consistent,
+ * so it may be reopened even if the process ends without pgfile_close(). Returns nonzero on success.
+ */
+int pgfile_sync(PgFile *);
+
+/*
+ * Syncs and unmaps the specified file heap and frees the handle. Blocks of the heap may no longer be used.
+ * If the specified file heap is NULL, no action is taken.
+ */
+void pgfile_close(PgFile *);
+
+/*
+ * Returns a pointer to a zero filled memory block large enough to hold the specified number of elements
+ * of the specified size or NULL on error, including when the total size overflows.
+ * Blocks that have never been handed out from freshly mapped pages are already zero and are not cleared again.
+ */
+void *pgcalloc(size_t, size_t);
+
+/*
+ * Resize the block referenced to hold the requested bytes, preserving its contents up to the smaller of the old and new sizes.
+ * Returns the same pointer while the request still fits the block, see pgusable_size(), otherwise the contents are moved
+ * to a new block and the old one is freed. Returns NULL on error, in which case the original block is left untouched.
+ * A NULL pointer behaves like pgalloc(), a request of 0 bytes frees the block and returns NULL.
+ */
+void *pgrealloc(void *, size_t);
+
+/*
+ * Return nonzero if the specified pointer refers to memory handed out by pgalloc, 0 for any other pointer.
+ * Unlike the other calls this is safe for pointers from any allocator, which lets a program hand a pointer
+ * of unknown origin to either pgfree() or the allocator it came from.
+ */
+int pgowns(const void *);
+
+/*
+ * Return the number of bytes that may be used in the block referenced, which is at least the number requested.
+ * Returns 0 for a NULL pointer.
+ */
+size_t pgusable_size(void *);
+
+/*
+ * Generate a diagnostic print out on STDOUT of all pages owned by the calling thread
+ * and all pages handed back by threads that have exited.
  */
 void pgview(void);
 
+/*
+ * Return unused memory to the OS right away instead of waiting for it to decay, see pgdecay().
+ * Releases the empty pages kept by the calling thread, every free page and chunk and every cached large span.
+ * Returns the number of bytes returned to the OS.
+ */
+size_t pgtrim(void);
+
+/*
+ * Set how long in milliseconds a free page is kept before it is returned to the OS and how many free pages
+ * may be kept at most before all of them are returned. Defaults to 10 seconds and 2048 pages.
+ */
+void pgdecay(unsigned int, unsigned int);
+
+/*
+ * Take new pages for the calling thread from chunks of the specified NUMA node, or of the node the thread is running on
+ * when it is -1, which is the default. Chunks are bound to their node where the machine has it, freed pages go back to
+ * the chunk they came from and so to its node. Returns nonzero on success, 0 if the node is not below PG_STATS_NODES.
+ */
+int pgnode(int);
+
+/*
+ * Fill in the specified PgStats with a snapshot of the allocator.
+ * Every counter is kept up to date as blocks come and go, so this only sums them and never walks any pages.
+ * Counters of other threads are read while they keep changing, so the snapshot is not exact under load.
+ * Blocks freed by a thread other than the one that allocated them count as used until they are reclaimed.
+ */
+void pgstats(PgStats *);
+
+/*
+ * Describes one page to the callback of pgwalk().
+ */
+typedef struct PgWalkPage {
+    const void *page;           // start of the page
+    size_t spanBytes;           // bytes of memory taken by the page
+    size_t blockSize;           // block size, for a large span the usable size of its single block
+    unsigned int maxBlocks;     // blocks that fit in the page
+    unsigned int usedBlocks;    // blocks in use
+    unsigned int freeBlocks;    // blocks freed and waiting for reuse, see PgFreeBlocks()
+    size_t tailBytes;           // bytes after the last block too small to hold another one
+    int pool;                   // nonzero if the page belongs to a thread that has exited
+    int cache;                  // nonzero if the page belongs to a cache, see pgcache_create()
+    int large;                  // nonzero if the page is a span holding a single large block
+    int arena;                  // nonzero if the page is a span of an arena, listed as a single block like a large span
+    int node;                   // NUMA node of the chunk holding the page, -1 for a large span
+} PgWalkPage;
+
+/*
+ * Called by pgwalk() for every page, returns nonzero to stop the walk.
+ */
+typedef int (*PgWalkCallback)(const PgWalkPage *, void *);
+
+/*
+ * Call the specified callback with every page owned by the calling thread, every page of a cache, every page handed back by
+ * threads that have exited, every span of an arena and every large span, passing along the specified context.
+ * Pages owned by other running threads are not visited, call pgwalk() from those threads to see them.
+ * The callback must not allocate or free memory with pgalloc. Returns the number of pages visited.
+ */
+size_t pgwalk(PgWalkCallback, void *);
+
+/*
+ * Number of utilization buckets reported by pgfrag().
+ */
+#define PG_FRAG_BUCKETS 11
+
+/*
+ * Fragmentation of one size class, see pgfrag().
+ */
+typedef struct PgFragClass {
+    unsigned int blockSize;     // block size of this class
+    size_t pages;               // pages of this class
+    size_t usedBlocks;          // blocks in use
+    size_t utilization[PG_FRAG_BUCKETS];    // pages by share of blocks in use, [0] is empty pages
+                                            // and [k] pages more than (k - 1) and at most k tenths used
+    size_t reclaimablePages;    // pages that would be freed if the blocks in use were packed into as few pages as possible
+    size_t freeBytes;           // bytes in blocks not in use
+    size_t tailBytes;           // bytes after the last block of each page too small to hold another block
+} PgFragClass;
+
+/*
+ * Fragmentation of every size class, see pgfrag().
+ */
+typedef struct PgFragStats {
+    unsigned int classes;       // number of entries used in sizeClass
+    PgFragClass sizeClass[PG_STATS_CLASSES];
+} PgFragStats;
+
+/*
+ * Fill in the specified PgFragStats from the pages visited by pgwalk().
+ */
+void pgfrag(PgFragStats *);
+
+/*
+ * Operations recorded in a trace, see PgTraceRecord.
+ */
+#define PG_TRACE_ALLOC 1
+#define PG_TRACE_FREE  2
+
+/*
+ * One call recorded by pgtrace(). A trace file is nothing but these records in the order the calls returned.
+ */
+typedef struct PgTraceRecord {
+    uint64_t time;              // nanoseconds since the trace started
+    uint64_t ptr;               // address of the block, which identifies it from its allocation until it is freed
+    uint64_t size;              // bytes requested, 0 for a free
+    uint32_t thread;            // number of the calling thread, from 1 in the order threads first called the allocator
+    uint32_t op;                // PG_TRACE_ALLOC or PG_TRACE_FREE
+} PgTraceRecord;
+
+/*
+ * Record every block allocated and freed with pgalloc(), pgcalloc(), pgrealloc(), pgalloc_aligned(), the bulk calls
+ * and pgfree() into the file at the specified path, which is created or truncated, replacing any trace being recorded.
+ * A NULL path stops recording and writes out the records still buffered, as does the program exiting. Only a library built with PG_TRACE records
+ * anything; it also starts recording into the file named by the PGALLOC_TRACE environment variable when it is loaded.
+ * Returns nonzero on success, 0 if the file cannot be created or the library was built without PG_TRACE.
+ */
+int pgtrace(const char *);
+
+/*
+ * Sample one allocation of the pgalloc() family for every specified number of bytes allocated on average, or stop sampling
+ * if 0. A sampled block is kept in a span of its own together with the stack of the call that allocated it until it is
+ * freed, see pgprofile_dump(). The profiler also starts at one sample per 512 KiB when the library is loaded with the
+ * PGALLOC_PROFILE environment variable set to a path, and then writes its profile there when the program exits.
+ * Returns the rate set before.
+ */
+size_t pgprofile(size_t);
+
+/*
+ * Write every sampled block still live with its size and stack into the file at the specified path, which is created or
+ * truncated. The file is a legacy heap profile that pprof reads and scales up to estimated totals, followed by the
+ * mappings of the process for symbolization. Returns nonzero on success, 0 if the file cannot be written.
+ */
+int pgprofile_dump(const char *);
+
 /*
  * Return a pointer to the PageHeader for the page backing the specified pointer or NULL on error.
  */
@@ -40,6 +388,7 @@ unsigned int PgUsedBlocks(PageHeader *);
 
 /*
  * Return the block size used by the page managed by the specified PageHeader.
+ * Large requests are served from a span holding a single block, for which this is the usable size of that block.
  */
 unsigned int PgBlockSize(PageHeader *);
 
@@ -52,7 +401,121 @@ unsigned int PgMaxBlocks(PageHeader *);
 /*
  * Return the total number of free blocks in the page managed by the specified PageHeader.
  * This only includes previously allocated blocks that were recycled and not blocks that have never before been allocated.
+ * Blocks freed by other threads are only counted once the owning thread has reclaimed them.
  */
 unsigned int PgFreeBlocks(PageHeader *);
 
+/*
+ * Inline fast path for pgalloc().
+ * The types below mirror the leading fields of the library's own PageHeader and heap, which checks them at compile time.
+ * They are only meant for pgalloc_inline() and may change with any release of the ABI.
+ */
+
+/*
+ * Size classes and the largest request served from a page, see scripts/sizeclasses.
+ */
+#define PG_SIZE_CLASSES 33
+#define PG_SMALL_MAX    8128
+#define PG_PAGE_HEADER  64
+#define PG_CACHE_LINE   64
+
+/*
+ * Size class of a request of up to PG_SMALL_MAX bytes: 8 bytes, then 16 byte steps up to 128 bytes,
+ * then four classes per doubling. Folds to a constant for constant requests.
+ */
+#define PG_SIZE_CLASS_LOG2(n) (63 - __builtin_clzll((unsigned long long)(n) - 1))
+#define PG_SIZE_CLASS(n) ((n) <= 8 ? 0U : (n) <= 128 ? (unsigned int)(((n) + 15) / 16) : \
+    (unsigned int)((4 * PG_SIZE_CLASS_LOG2(n)) - 20 + \
+    (int)((((unsigned long long)(n) - 1 - (1ULL << PG_SIZE_CLASS_LOG2(n))) >> (PG_SIZE_CLASS_LOG2(n) - 2)) + 1)))
+
+typedef struct PgFastPage {
+    unsigned int blockSize;
+    unsigned short blocksUsed;
+    unsigned short flags;
+    void *freeList;
+    void *avl;
+} PgFastPage;
+
+typedef struct PgFastStats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t requested;
+    uint64_t newPages;
+    uint64_t pages;
+    uint64_t fullPages;
+} PgFastStats;
+
+typedef struct PgFastHeap {
+    void *remotePages;
+    char pad[PG_CACHE_LINE - sizeof(void *)];
+    PgFastPage *pages[PG_SIZE_CLASSES];
+    PgFastStats stats[PG_SIZE_CLASSES];
+} PgFastHeap;
+
+#if defined(__GNUC__) && !defined(__cplusplus) && !defined(PG_NO_INLINE)
+
+/*
+ * Heap of the calling thread, NULL until its first allocation and always in a library built with PG_BITMAP_PAGES,
+ * PG_HEADER_TABLE or PG_TRACE.
+ */
+extern _Thread_local PgFastHeap *pgFastHeap __attribute__((tls_model("initial-exec")));
+
+/*
+ * Bytes the calling thread may allocate before the heap profiler takes its next sample, see pgprofile().
+ */
+extern _Thread_local size_t pgSampleLeft __attribute__((tls_model("initial-exec")));
+
+/*
+ * Allocate a block of the specified size class for a request of the specified bytes from the page the calling thread
+ * is currently filling, without leaving the caller. Falls back to pgalloc() whenever the page would run out,
+ * so only the library ever moves pages between lists or reclaims blocks other threads have freed, and whenever the
+ * request is due to be sampled.
+ */
+static inline void *pgalloc_inline(unsigned int index, size_t bytes)
+{
+    PgFastHeap *heap = pgFastHeap;
+    PgFastPage *page = heap ? heap->pages[index] : NULL;
+
+    if (!page || __atomic_load_n(&(heap->remotePages), __ATOMIC_RELAXED) || bytes > pgSampleLeft) {
+        return (pgalloc)(bytes);
+    }
+
+    void *block = page->freeList;
+    size_t below = (size_t)((char *)page->avl - (char *)page) - PG_PAGE_HEADER;
+
+    if (block) {
+        void *next = *((void **)block);
+
+        if (!next && below < page->blockSize) {
+            // last block of the page
+            return (pgalloc)(bytes);
+        }
+        page->freeList = next;
+    } else {
+        if (below < 2 * (size_t)page->blockSize) {
+            return (pgalloc)(bytes);
+        }
+        block = (char *)page->avl - page->blockSize;
+        page->avl = block;
+    }
+
+    page->blocksUsed++;
+    pgSampleLeft -= bytes;
+
+    // only this thread writes its counters, pgstats() reads them from any thread
+    PgFastStats *stats = &(heap->stats[index]);
+    __atomic_store_n(&(stats->allocs), __atomic_load_n(&(stats->allocs), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(stats->requested), __atomic_load_n(&(stats->requested), __ATOMIC_RELAXED) + bytes, __ATOMIC_RELAXED);
+
+    return block;
+}
+
+/*
+ * Requests of a constant size resolve their size class at compile time and take the inline fast path.
+ */
+#define pgalloc(bytes) (__builtin_constant_p(bytes) && (bytes) <= PG_SMALL_MAX ? \
+    pgalloc_inline(PG_SIZE_CLASS(bytes), (bytes)) : (pgalloc)(bytes))
+
+#endif
+
 #endif /* PGALLOC_H */
@@ -0,0 +1,181 @@
+// Copyright (C) 2024 Alexander Necheff
+// This program is licensed under the terms of the LGPLv3.
+// See the COPYING and COPYING.LESSER files that came packaged with this source code for the full terms.
+
+/*
+ * Replaces the malloc() family with pgalloc when loaded with LD_PRELOAD, see libpgalloc_malloc.so in the Makefile.
+ * Pointers glibc handed out before this library took over, or that it still hands out itself, are passed
+ * back to glibc, see pgowns(). Nothing here or in pgalloc calls malloc(), so every call is safe before
+ * constructors have run. The one exception is backtrace() in the heap profiler, see pgprofile(), which may allocate
+ * while loading its unwinder and then simply comes back here without holding any lock of pgalloc.
+ */
+
+/* needed for RTLD_NEXT */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include <pgalloc.h>
+
+/*
+ * glibc's own allocator, exported for exactly this purpose.
+ */
+extern void __libc_free(void *);
+extern void *__libc_realloc(void *, size_t);
+
+/*
+ * glibc's malloc_usable_size(), looked up by resolveLibc().
+ */
+static size_t (*libcUsableSize)(void *) = NULL;
+
+/*
+ * Return a block aligned on the specified alignment, setting errno on error.
+ */
+static void *alignedAlloc(size_t, size_t);
+
+/*
+ * Look up libcUsableSize while the program is still single threaded. dlsym() may allocate, which is fine by then.
+ */
+static void resolveLibc(void);
+
+void *malloc(size_t bytes)
+{
+    void *ptr = pgalloc(bytes);
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (pgowns(ptr)) {
+        pgfree(ptr);
+    } else {
+        __libc_free(ptr);
+    }
+}
+
+void *calloc(size_t num, size_t size)
+{
+    void *ptr = pgcalloc(num, size);
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t bytes)
+{
+    if (ptr && !pgowns(ptr)) {
+        // a block glibc allocated stays with glibc for its whole life
+        return __libc_realloc(ptr, bytes);
+    }
+
+    void *mem = pgrealloc(ptr, bytes);
+
+    if (!mem && (bytes || !ptr)) {
+        errno = ENOMEM;
+    }
+
+    return mem;
+}
+
+void *reallocarray(void *ptr, size_t num, size_t size)
+{
+    if (size && num > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return realloc(ptr, num * size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t bytes)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+
+    void *ptr = pgalloc_aligned(alignment, bytes);
+
+    if (!ptr) {
+        return ENOMEM;
+    }
+
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t bytes)
+{
+    return alignedAlloc(alignment, bytes);
+}
+
+void *memalign(size_t alignment, size_t bytes)
+{
+    return alignedAlloc(alignment, bytes);
+}
+
+void *valloc(size_t bytes)
+{
+    return alignedAlloc((size_t)sysconf(_SC_PAGESIZE), bytes);
+}
+
+void *pvalloc(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (bytes > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return alignedAlloc(page, (bytes + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    if (pgowns(ptr)) {
+        return pgusable_size(ptr);
+    }
+
+    return libcUsableSize ? libcUsableSize(ptr) : 0;
+}
+
+static void *alignedAlloc(size_t alignment, size_t bytes)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *ptr = pgalloc_aligned(alignment, bytes);
+
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+__attribute__((constructor)) static void resolveLibc(void)
+{
+    *(void **)(&libcUsableSize) = dlsym(RTLD_NEXT, "malloc_usable_size");
+}
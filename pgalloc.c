@@ -2,34 +2,217 @@
 // This program is licensed under the terms of the LGPLv3.
 // See the COPYING and COPYING.LESSER files that came packaged with this source code for the full terms.
 
-/* needed for posix_memalign */
+/* needed for clock_gettime and pthread_atfork */
 #define _POSIX_C_SOURCE 200112L
+/* needed for MAP_ANONYMOUS, MAP_NORESERVE, MAP_FIXED_NOREPLACE, MADV_DONTNEED, MADV_HUGEPAGE and flock */
+#define _DEFAULT_SOURCE
 
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
+/* pgalloc() is defined here, not inlined */
+#define PG_NO_INLINE
 #include <pgalloc.h>
 
-// need to calc max PAGES at compile time
-#define PAGES          1024
 #define PAGE_SIZE      8192
-#define BBLOCK_SIZE    8
+#define PAGE_SHIFT     13
+#define CACHE_LINE     64
+
+/*
+ * Pages are carved from CHUNK_SIZE aligned chunks. Each chunk starts with a ChunkHeader
+ * mapping every page in the chunk to the span holding it, see getPage().
+ */
+#define CHUNK_SIZE     (2 * 1024 * 1024)
+#define CHUNK_SHIFT    21
+#define CHUNK_PAGES    (CHUNK_SIZE / PAGE_SIZE)
+#define SMALL_CHUNK    1
+
+/*
+ * Every CHUNK_SIZE region of the user address space is marked with what pgalloc mapped at its start, see pgowns().
+ * REGION_MAP_BITS is the width of user space addresses, each region takes 2 bits of the region map.
+ */
+#define REGION_NONE     0
+#define REGION_CHUNK    1
+#define REGION_LARGE    2
+#define REGION_MAP_BITS 47
+#define REGIONS         (((uintptr_t)1) << (REGION_MAP_BITS - CHUNK_SHIFT))
+#define REGION_MAP_SIZE (REGIONS / 4)
+
+/*
+ * Heaps are carved from HEAP_SLAB bytes mapped at a time, see newHeap().
+ */
+#define HEAP_SLAB      (64 * 1024)
+
+/*
+ * Every heap keeps up to EMPTY_CACHE empty pages per size class, the rest go back to their chunk.
+ * Free pages in a chunk are returned to the OS once they have been free for DECAY_MS or once more
+ * than DIRTY_PAGES_MAX free pages are waiting, see pgdecay(). Up to RETAIN_CHUNKS entirely free chunks are kept.
+ */
+#define EMPTY_CACHE     2
+#define DECAY_MS        10000
+#define DIRTY_PAGES_MAX 2048
+#define RETAIN_CHUNKS   1
+
+/*
+ * Chunks are kept per NUMA node, for up to NUMA_NODES nodes; higher nodes share the last pool and are left unbound.
+ * Chunks of a node are bound to it with mbind(2) using MPOL_PREFERRED, so pages still come from elsewhere when the node runs out.
+ */
+#define NUMA_NODES      PG_STATS_NODES
+#define NODE_POSSIBLE   "/sys/devices/system/node/possible"
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+
+/*
+ * Size classes are generated at build time by scripts/sizeclasses.
+ */
+#include "sizeclasses.inc"
+
+/*
+ * Requests larger than maxPageData are served by spans mapped directly from the OS.
+ * Freed spans up to LARGE_CACHE_MAX bytes are kept for reuse, bounded by LARGE_CACHE_BYTES in total.
+ */
+#define LARGE_BLOCK          0
+#define LARGE_OFFSET         CACHE_LINE
+#define LARGE_CACHE_MAX      (1024 * 1024)
+#define LARGE_CACHE_BYTES    (32 * 1024 * 1024)
+#define LARGE_CACHE_CLASSES  26
+#define LARGE_ALIGN_MAX      (CHUNK_SIZE / 2)
+#define OS_PAGE_SIZE         4096
+
+/*
+ * A file heap maps a file of CHUNK_SIZE chunks laid out like the chunks mapped from the OS, so getPage() finds its pages.
+ * Its FileHeader follows the ChunkHeader of the first chunk and starts with FILE_MAGIC.
+ */
+#define FILE_MAGIC           UINT64_C(0x31454c4946475000)
+
+/*
+ * Arenas bump allocate from spans of ARENA_PAGES pages taken from the chunks. Requests over ARENA_DIRECT bytes get a span
+ * of their own, or a large span when they need more than ARENA_SPAN_MAX pages. Every span starts with ARENA_HEADER bytes of bookkeeping.
+ */
+#define ARENA_PAGES          8
+#define ARENA_DIRECT         (2 * PAGE_SIZE)
+#define ARENA_SPAN_MAX       (CHUNK_PAGES / 4)
+#define ARENA_HEADER         64
+
+/*
+ * Building with PG_NO_FULL_LIST leaves full pages off the fullPages list and only counts them, so filling a page or freeing
+ * into a full one no longer touches its neighbours. pgview(), pgwalk() and pgfrag() then skip full pages, and a thread that
+ * exits leaves its full pages with its heap for the next thread taking it, see collectPool().
+ */
+
+/*
+ * Building with PG_BITMAP_PAGES tracks the blocks of a page with a bit each in PageHeader::bitmap instead of the freeList.
+ * Bit i stands for the i-th block down from the end of the span and is set while the block is in use; bits past the last
+ * block are set from the start. Allocation takes the lowest clear bit, so blocks are reused in address order from the end
+ * of the span, and freeing a block of the calling thread writes nothing but its bit, which also catches a block freed twice.
+ * Blocks freed by other threads are still chained through the blocks themselves until the owner collects them.
+ * pgalloc_inline() always falls back to pgalloc() in such a build.
+ */
+
+/*
+ * Building with PG_HEADER_TABLE keeps the PageHeader of every span in a table at the head of its chunk, indexed by the
+ * first page of the span, instead of at the start of the span. Headers then sit next to each other rather than all at the
+ * same offset of PAGE_SIZE aligned pages, where they would compete for the same few cache sets, and spans are left
+ * entirely to blocks. A PageHeader no longer gives the address of its span, see spanStart(), and pgalloc_inline() always
+ * falls back to pgalloc() in such a build.
+ */
+
+/*
+ * Building with PG_TRACE records every allocation and free of the pgalloc() family into a file, see pgtrace().
+ * Records are gathered in traceBuffer under traceLock and written out TRACE_RECORDS at a time, so a traced call costs a
+ * clock read and a lock. A build without PG_TRACE compiles every trace call away, and pgalloc_inline() always falls back to
+ * pgalloc() in a build with it so that no allocation escapes the trace.
+ */
+#define TRACE_RECORDS        4096
+#define TRACE_ENV            "PGALLOC_TRACE"
+
+/*
+ * The heap profiler samples one allocation for every profileRate bytes requested on average, see pgprofile(). Each thread
+ * counts pgSampleLeft down by the bytes it requests and only calls sampleAlloc() once it would run out, so an allocation
+ * that is not sampled pays a subtraction and a branch whether the profiler runs or not. The bytes to the next sample are
+ * drawn from an exponential distribution, which is what pprof assumes when it scales samples up to estimated totals.
+ * A sampled block gets a large span of its own with its Sample between the LargeHeader and the block, so pgfree() tells
+ * it apart by the header it reads anyway. While the profiler is stopped a thread looks at profileRate again every
+ * PROFILE_IDLE bytes.
+ */
+#define PROFILE_RATE         (512 * 1024)
+#define PROFILE_IDLE         (1024 * 1024)
+#define PROFILE_DEPTH        32
+#define PROFILE_LINE         1024
+#define PROFILE_ENV          "PGALLOC_PROFILE"
+#define SAMPLE_OFFSET        512
+
+/*
+ * PageHeader flags.
+ * PAGE_ZEROED marks a span carved from pages that were never written or have been returned to the OS,
+ * so blocks not yet handed out from avl are known to be zero filled, see pgcalloc().
+ */
+#define PAGE_ZEROED          1
+
+/*
+ * Pages that get blocks back after filling up are parked in one of PARTIAL_BUCKETS lists by how full they are, and a
+ * heap whose current page fills up carries on with the fullest of them, see unparkPage(). Nearly empty pages are left
+ * to drain until they can go back to their chunk. The bucket of a parked page, plus 1, is kept in its flags from
+ * PAGE_BUCKET_SHIFT up and is 0 for any page that is not parked.
+ */
+#define PARTIAL_BUCKETS      4
+#define PAGE_BUCKET_SHIFT    8
+#define PAGE_FLAGS_MASK      ((1 << PAGE_BUCKET_SHIFT) - 1)
+
+/*
+ * pgfree_bulk() gathers the blocks of up to BULK_PAGES pages before handing each page its blocks at once.
+ */
+#define BULK_PAGES           8
 
 typedef struct PageHeader PageHeader;
+typedef struct Heap Heap;
+typedef struct LargeHeader LargeHeader;
+typedef struct ChunkHeader ChunkHeader;
+typedef struct ClassStats ClassStats;
+typedef struct WalkState WalkState;
+typedef struct ArenaSpan ArenaSpan;
+typedef struct NodePool NodePool;
+typedef struct FileHeader FileHeader;
+typedef struct Sample Sample;
 
 /*
- * Adds specified page to the fullPages list.
+ * Adds specified page to the fullPages list of the specified heap.
  */
-static void addFullList(void *);
+static void addFullList(Heap *, void *);
 
 /*
- * Removes specified page from the fullPages list, typically when a full page has blocks freed.
+ * Removes specified page from the fullPages list of the specified heap, typically when a full page has blocks freed.
  * Returns a reference to the page.
  */
-static void *removeFullList(void *);
+static void *removeFullList(Heap *, void *);
+
+/*
+ * Push the specified page onto the head of the specified page list.
+ */
+static void pushPage(void **, void *);
+
+/*
+ * Unlink the specified page from the specified page list.
+ */
+static void unlinkPage(void **, void *);
 
 /*
  * Return a pointer to the page that holds the block referenced.
@@ -43,291 +226,3779 @@ static void *getPage(void *);
 static unsigned int blocksPerPage(void *);
 
 /*
- * Print diagnostic information about the specified page.
+ * Print diagnostic information about the specified page, see walkHeap().
  */
-static void printPage(void *);
+static int printPage(void *, void *);
 
 /*
- * Return a new page using blocks of the specified block size and byte aligned on PAGE_SIZE or NULL on error.
+ * Return a new span owned by the specified heap using blocks of the specified size class or NULL on error.
  */
-static void *newPage(unsigned int);
+static void *newPage(Heap *, unsigned int);
 
 /*
- * Return an index into the page table corrisponding to the specified byte request.
+ * Return a block of the specified size class from the specified heap for a request of the specified bytes or NULL on error.
+ * If the int referenced is not NULL, it is set to whether the block is known to be zero filled.
  */
-static unsigned int getPageIndex(unsigned int);
+static void *allocBlock(Heap *, unsigned int, size_t, int *);
 
 /*
- * Return the number of blocks available to be allocated in the specified page.
- * This includes both never before allocated blocks as well as recycled blocks.
+ * Add a span of the specified number of pages to the specified arena and return it or NULL on error.
  */
-static unsigned int blocksLeft(void *);
+static ArenaSpan *newArenaSpan(PgArena *, unsigned int);
 
 /*
- * Defines how bookkeeping is stored at the head of a given page.
+ * Return a block of the specified bytes from a span or large span of its own in the specified arena or NULL on error.
  */
-struct PageHeader {
-    unsigned int blockSize;     // block size in bytes for this Page
-    unsigned int blocksUsed;    // number of blocks used in this Page
-    void *freeList;             // recycled blocks in this Page
-    void *avl;                  // next available block
-    void *nextPage;
-    void *prevPage;
-};
+static void *arenaDirect(PgArena *, size_t);
 
+/*
+ * Return every span and large block of the specified arena but its first span.
+ */
+static void releaseArena(PgArena *);
 
 /*
- * Used to track the largest data that can be stored in a single page
+ * Run the destructor of the specified cache on every object ever handed out from the specified empty page.
  */
-static unsigned int maxPageData = PAGE_SIZE - sizeof(PageHeader);
+static void destroyObjects(PgCache *, void *);
 
+/*
+ * Return a run of the specified number of free pages from the chunks of the specified file heap or NULL if there is none.
+ * Sets the int referenced to whether every page in the run is known to be zero filled. The caller must hold the file's lock.
+ */
+static void *fileSpan(PgFile *, unsigned int, int *);
 
-/* track pages with avilable blocks */
-static void *pages[PAGES] = { NULL };
+/*
+ * Return the span of the specified page of a file heap to its chunk. The caller must hold the file's lock.
+ */
+static void fileRelease(void *);
 
 /*
- * Track full pages for debug purposes only, see pgview()
+ * Lay out a new file heap with the specified number of chunks in the zero filled mapping starting at the specified chunk.
  */
-static void *fullPages = NULL;
+static void formatFile(ChunkHeader *, unsigned int);
 
 /*
- * Mainly used as a way to get a pointer to front
- * of page given a pointer to an arbitrary point
- * in page. See pgfree().
+ * Return true if the specified FileHeader describes a consistent file heap mapped at the specified address with the specified size,
+ * laid out by this build.
  */
-static uintptr_t pageMask = ~((uintptr_t) (PAGE_SIZE - 1));
+static int fileMatches(const FileHeader *, uintptr_t, size_t);
 
-static unsigned int getPageIndex(unsigned int byteRequest)
-{
-    unsigned int i = 0;
+/*
+ * Mark every chunk of the specified file heap with the specified REGION_* kind. Returns 0 if a region cannot be tracked.
+ */
+static int markFile(PgFile *, unsigned int);
 
-    if ((byteRequest % BBLOCK_SIZE) == 0) {
-        i = byteRequest / BBLOCK_SIZE;
-    } else {
-        i = byteRequest % BBLOCK_SIZE;
-        i = BBLOCK_SIZE - i + byteRequest;
-        i /= BBLOCK_SIZE;
-    }
-    // handle zero indexing
-    i--;
+/*
+ * Record on disk that the specified file heap is about to change and no longer matches its last pgfile_sync().
+ * The caller must hold the file's lock.
+ */
+static void touchFile(PgFile *);
 
-    assert(i <= PAGES);
-    return i;
-}
+/*
+ * Return the first page with available blocks of the specified size class in the specified heap,
+ * reusing an empty page or creating a new one if there is none, or NULL on error.
+ */
+static void *availPage(Heap *, unsigned int);
 
-void pgfree(void *ptr)
-{
-    if (!ptr) {
-        return;
-    }
+/*
+ * Move up to the specified number of blocks from the specified page into the specified array, free blocks first,
+ * then the rest carved from avl in one step. Returns the number of blocks moved.
+ */
+static size_t takeBlocks(void *, void **, size_t);
 
-    void *page = getPage(ptr);
-    void *headPage = NULL;
-    PageHeader *ph = (PageHeader *)page;
+/*
+ * Takes the next block to hand out from the specified page, which must have one left, without counting it as used.
+ * Sets fresh if the block was never handed out before.
+ */
+static void *popBlock(void *, int *);
+
+/*
+ * Free the NULL terminated list of blocks, from its first to its last block, all taken from the specified page.
+ */
+static void freeBlocks(void *, void *, void *);
+
+/*
+ * Return the specified empty page of the specified heap to its chunk.
+ */
+static void dropPage(Heap *, void *);
+
+/*
+ * Add the counters of the specified heap to the specified statistics. The caller must hold poolLock.
+ */
+static void sumStats(PgStats *, Heap *);
+
+/*
+ * Add to or subtract from a statistics counter, see ClassStats.
+ */
+static void countAdd(_Atomic(uint64_t) *, uint64_t);
+static void countSub(_Atomic(uint64_t) *, uint64_t);
+
+/*
+ * Initialize the PageHeader of the specified span for the specified size class with the specified flags.
+ */
+static void initPage(void *, Heap *, unsigned int, unsigned short);
+
+/*
+ * Return a run of the specified number of free pages from a chunk of the calling thread's NUMA node or NULL on error.
+ * Sets the int referenced to whether every page in the run is known to be zero filled.
+ */
+static void *allocSpan(unsigned int, int *);
+
+/*
+ * Return the pages of the specified span to its chunk.
+ */
+static void freeSpan(void *);
+
+/*
+ * Return the specified number of pages starting at the specified page to their chunk. The caller must hold chunkLock.
+ */
+static void releasePages(void *, unsigned int);
+
+/*
+ * Return the first page of a run of the specified number of free pages in the specified chunk or -1 if there is none.
+ */
+static int findRun(ChunkHeader *, unsigned int);
 
-    if ((blocksPerPage(page)) == ph->blocksUsed) {
-        // page was previously full; add into avl pages
-        unsigned int i = getPageIndex(ph->blockSize);
+/*
+ * Return a new chunk bound to the specified NUMA node with every page after the header free or NULL on error.
+ * The caller must hold chunkLock.
+ */
+static ChunkHeader *newChunk(unsigned int);
+
+/*
+ * Return free pages that are no longer needed to the OS. With force set every free page is returned,
+ * otherwise only those that have been free for longer than decayMs, or all of them when there are more than maxDirtyPages.
+ * Returns the number of bytes returned. The caller must hold chunkLock.
+ */
+static size_t decayChunks(int);
+
+/*
+ * Return every free page of the specified chunk to the OS and the number of bytes returned.
+ * The caller must hold chunkLock.
+ */
+static size_t purgeChunk(ChunkHeader *);
+
+/*
+ * Return the current time in milliseconds from a monotonic clock.
+ */
+static uint64_t nowMs(void);
+
+/*
+ * Return the NUMA node pages for the calling thread come from, see pgnode().
+ */
+static unsigned int currentNode(void);
+
+/*
+ * Find the number of NUMA nodes the machine may have, see numaNodes.
+ */
+static void findNodes(void);
+
+/*
+ * Push the specified chunk onto the list of chunks with free pages.
+ */
+static void pushChunk(ChunkHeader *);
+
+/*
+ * Unlink the specified chunk from the list of chunks with free pages.
+ */
+static void unlinkChunk(ChunkHeader *);
+
+/*
+ * Return the heap owned by the calling thread, claiming one on first use, or NULL on error.
+ */
+static Heap *getHeap(void);
+
+/*
+ * Hand every page of the specified heap back to the shared pool when its thread exits.
+ */
+static void releaseHeap(void *);
+
+/*
+ * Return the specified block to the specified page owned by the specified heap.
+ */
+static void recycleBlock(Heap *, void *, void *);
+
+/*
+ * Return the specified list of blocks, from its first to its last block, to the specified page owned by another thread's heap.
+ * Costs a single compare and swap unless the page has no other pending remote frees,
+ * in which case the page is also queued on the owning heap's remotePages list.
+ */
+static void remoteFree(Heap *, void *, void *, void *);
+
+/*
+ * Reclaim in bulk every block other threads have freed into pages owned by the specified heap.
+ */
+static void collectRemote(Heap *);
+
+/*
+ * Return a NULL terminated list of blocks to the specified page owned by the specified heap.
+ */
+static void recycleBlocks(Heap *, void *, void *);
+
+/*
+ * Move the specified empty page out of the page table of the specified heap into its empty page cache,
+ * or back to its chunk when the cache is full. The only page left for a size class is kept where it is.
+ */
+static void retirePage(Heap *, void *);
+
+/*
+ * Park the specified page of the specified heap, which has just had blocks freed after filling up or is parked
+ * in a bucket it has since drained below, in the partial bucket matching how full it now is.
+ */
+static void parkPage(Heap *, void *);
+
+/*
+ * Move the fullest parked page of the specified size class to the pages the specified heap allocates from and return it,
+ * or return NULL if no page is parked. Parked pages only ever drain, so a page found below its bucket is parked again
+ * on the way rather than moved on every free.
+ */
+static void *unparkPage(Heap *, unsigned int);
+
+/*
+ * Return the partial bucket for the occupancy of the specified page, which must have a block left.
+ */
+static unsigned int pageBucket(void *);
+
+/*
+ * Return the list of pages with available blocks of the specified heap holding the specified page.
+ */
+static void **availList(Heap *, void *);
+
+/*
+ * Return every empty page of the specified heap to its chunk.
+ */
+static void releaseEmptyPages(Heap *);
+
+/*
+ * Reclaim remote frees into the shared pool and into heaps no longer owned by a thread.
+ * The caller must hold poolLock.
+ */
+static void collectPool(void);
+
+/*
+ * Return the specified pool page to its chunk if it no longer holds any blocks.
+ * The caller must hold poolLock.
+ */
+static void releasePoolPage(void *);
+
+/*
+ * Return a block of at least the specified number of bytes aligned on the specified power of 2 from a span of its own,
+ * or NULL on error. The alignment may be at most LARGE_ALIGN_MAX.
+ * If the int referenced is not NULL, it is set to whether the block is known to be zero filled.
+ */
+static void *largeAlloc(size_t, size_t, int *);
+
+/*
+ * Release the specified large span, caching it for reuse when possible.
+ */
+static void largeFree(void *);
+
+/*
+ * Return the size of the span needed to hold the specified byte request, or 0 on overflow.
+ * Sizes up to LARGE_CACHE_MAX are rounded up to one of LARGE_CACHE_CLASSES sizes so freed spans are easily reused.
+ */
+static size_t spanSize(size_t);
+
+/*
+ * Return the span cache index for the specified span size, which must come from spanSize().
+ */
+static unsigned int spanIndex(size_t);
+
+/*
+ * Return the specified number of bytes of new memory from the OS aligned on the specified alignment or NULL on error.
+ */
+static void *mapPages(size_t, size_t);
+
+/*
+ * Return true if the specified page holds a large span rather than small blocks.
+ */
+static int isLargePage(void *);
+
+/*
+ * Mark the CHUNK_SIZE region starting at the specified address with the specified REGION_* kind.
+ * Returns 0 if the region cannot be tracked.
+ */
+static int markRegion(void *, unsigned int);
+
+/*
+ * Return the REGION_* kind of the CHUNK_SIZE region holding the specified address.
+ */
+static unsigned int regionKind(const void *);
+
+/*
+ * Return the pages of the specified large span to the OS. Must be called with largeLock held.
+ */
+static void unmapSpan(void *);
+
+/*
+ * Push the specified large span onto the head of the specified span list.
+ */
+static void pushSpan(void **, void *);
+
+/*
+ * Unlink the specified large span from the specified span list.
+ */
+static void unlinkSpan(void **, void *);
+
+/*
+ * Create heapKey, see getHeap().
+ */
+static void createHeapKey(void);
+
+/*
+ * Return a zero filled heap that is never freed or NULL on error. Must be called with poolLock held.
+ */
+static Heap *newHeap(void);
+
+/*
+ * Return a heap no thread is using, from the heaps of threads that have exited or a new one, or NULL on error.
+ * The caller must hold poolLock.
+ */
+static Heap *takeHeap(void);
+
+/*
+ * Take or release every lock around fork() so the child does not inherit a lock held by another thread.
+ */
+static void lockAll(void);
+static void unlockAll(void);
+
+/*
+ * Release the locks taken by lockAll() in a child process, which leaves the trace of its parent alone.
+ */
+static void forkChild(void);
+
+/*
+ * Record a call of the specified PG_TRACE_* kind for the specified block and requested bytes if a trace is being recorded.
+ * Does nothing for a NULL block or in a build without PG_TRACE.
+ */
+static void traceEvent(uint32_t, const void *, size_t);
+
+/*
+ * Count the specified bytes towards the next sample of the calling thread. Returns nonzero instead once they would reach
+ * it, in which case sampleAlloc() must be called.
+ */
+static inline int countSample(size_t);
+
+/*
+ * Return a block of the specified bytes and alignment in a span of its own and record it as a sample of the heap profiler,
+ * or return NULL if the allocation is not to be sampled after all. Called once pgSampleLeft runs out, which it sets again.
+ * If the int referenced is not NULL, it is set to whether the block is known to be zero filled.
+ */
+static void *sampleAlloc(size_t, size_t, int *);
+
+/*
+ * Forget the sample kept in the specified large span, which is being freed.
+ */
+static void dropSample(void *);
+
+/*
+ * Return the bytes the calling thread may allocate before its next sample for the specified average.
+ */
+static size_t nextSample(size_t);
+
+/*
+ * Return the natural logarithm of the specified number, to about 4 digits.
+ */
+static double fastLog(uint64_t);
+
+/*
+ * Write the specified bytes to the specified file descriptor. Returns 0 on error.
+ */
+static int writeAll(int, const void *, size_t);
+
+/*
+ * Write the live samples into the file named by PROFILE_ENV when the program exits.
+ */
+static void endProfile(void);
+
+#ifdef PG_TRACE
+/*
+ * Write out the records in traceBuffer. The caller must hold traceLock.
+ */
+static void flushTrace(void);
+
+/*
+ * Stop recording when the program exits so the records still buffered reach the trace.
+ */
+static void endTrace(void);
+
+/*
+ * Return the time in ns on a monotonic clock.
+ */
+static uint64_t nowNs(void);
+#endif
+
+/*
+ * Print diagnostic information about every page in the specified heap.
+ */
+static void viewHeap(Heap *);
+
+/*
+ * Call the specified function with every page of the specified heap and the specified argument
+ * until it returns nonzero. Returns the last value returned.
+ */
+static int walkHeap(Heap *, int (*)(void *, void *), void *);
+
+/*
+ * Describe the specified page to the callback of the specified WalkState, see pgwalk().
+ */
+static int walkPage(void *, void *);
+
+/*
+ * Describe the specified span of an arena of the specified number of pages to the callback of the specified WalkState.
+ * The caller must hold chunkLock.
+ */
+static int walkArenaSpan(WalkState *, void *, unsigned int);
+
+/*
+ * Add the specified page to the PgFragStats passed as the second argument, see pgfrag().
+ */
+static int fragPage(const PgWalkPage *, void *);
+
+/*
+ * Return an index into the page table corrisponding to the size class of the specified byte request.
+ */
+static unsigned int getPageIndex(unsigned int);
+
+/*
+ * Return the number of blocks available to be allocated in the specified page.
+ * This includes both never before allocated blocks as well as recycled blocks.
+ */
+static unsigned int blocksLeft(void *);
+
+/*
+ * Return the address just past the span of the specified page, where its first block ends.
+ */
+static uintptr_t spanEnd(void *);
+
+/*
+ * Return the address of the first page of the span described by the specified PageHeader.
+ */
+static uintptr_t spanStart(void *);
+
+/*
+ * Return the PageHeader of the span starting at the specified address, see PG_HEADER_TABLE.
+ */
+static PageHeader *spanHeader(void *);
+
+#ifdef PG_BITMAP_PAGES
+/*
+ * Marks the specified block of the specified page free, aborting if it was not in use.
+ */
+static void clearBlock(void *, void *);
+#endif
+
+/*
+ * Defines how bookkeeping is stored at the head of a given page.
+ * A page may span several PAGE_SIZE pages, see classPages[].
+ */
+struct PageHeader {
+    unsigned int blockSize;     // block size in bytes for this Page
+    unsigned short blocksUsed;  // number of blocks used in this Page
+    unsigned short flags;       // PAGE_ZEROED and the partial bucket, see PAGE_BUCKET_SHIFT
+    void *freeList;             // recycled blocks in this Page
+    void *avl;                  // next available block
+    void *nextPage;
+    void *prevPage;
+    _Atomic(Heap *) owner;      // heap this Page belongs to
+    _Atomic(void *) remoteFree; // blocks freed by threads other than the owner
+    void *remoteNext;           // next page in the owner's remotePages list
+#ifdef PG_BITMAP_PAGES
+    uint64_t bitmap[BITMAP_WORDS]; // blocks in use, see PG_BITMAP_PAGES
+#endif
+};
+
+/*
+ * Defines the statistics a heap keeps for one size class, see pgstats().
+ * Counters are only written by the thread owning the heap, with poolLock held for the pool or with the lock
+ * of the cache using the heap, so updating them takes a plain load and store. They are atomic only so pgstats() may read them from any thread.
+ */
+struct ClassStats {
+    _Atomic(uint64_t) allocs;       // blocks allocated
+    _Atomic(uint64_t) frees;        // blocks freed into pages of this heap, remote frees once reclaimed
+    _Atomic(uint64_t) requested;    // bytes requested by allocations
+    _Atomic(uint64_t) newPages;     // pages taken from chunks
+    _Atomic(uint64_t) pages;        // pages currently held
+    _Atomic(uint64_t) fullPages;    // pages currently full
+};
+
+/*
+ * Defines what pgwalk() passes through walkHeap() to walkPage().
+ */
+struct WalkState {
+    PgWalkCallback callback;
+    void *ctx;
+    int pool;                   // set while walking the pool
+    int cache;                  // set while walking the caches
+    size_t pages;               // pages visited so far
+};
+
+/*
+ * Defines the page table owned by a single thread.
+ * Only the owning thread touches a heap, so pgalloc() and pgfree() need no locking on the fast path.
+ */
+struct Heap {
+    /*
+     * Pages that have received blocks from other threads, see remoteFree().
+     * Kept on its own cache line since it is written by other threads.
+     */
+    alignas(CACHE_LINE) _Atomic(void *) remotePages;
+
+    // up to stats these are mirrored by PgFastHeap for pgalloc_inline()
+    alignas(CACHE_LINE) void *pages[SIZE_CLASSES];  // pages with available blocks
+    ClassStats stats[SIZE_CLASSES];
+    void *fullPages;            // full pages, for debug purposes only, see pgview() and PG_NO_FULL_LIST
+    Heap *nextHeap;             // next heap in the list of heaps not owned by any thread
+    Heap *nextAll;              // next heap in the list of every heap ever created
+    void *emptyPages[SIZE_CLASSES];         // empty pages kept for reuse, see retirePage()
+    unsigned int emptyCount[SIZE_CLASSES];  // number of pages in emptyPages
+    void *partialPages[SIZE_CLASSES][PARTIAL_BUCKETS]; // pages that filled up and got blocks back, emptiest first, see parkPage()
+    PgCache *cache;             // cache using this heap, NULL for the heap of a thread
+    PgFile *file;               // file heap keeping this heap in its FileHeader, NULL for any other heap
+};
+
+
+/*
+ * Defines the bookkeeping at the head of a span holding a single large block.
+ * Spans are aligned on CHUNK_SIZE and the block starts LARGE_OFFSET bytes into the span,
+ * so getPage() finds this header where it would otherwise find a ChunkHeader.
+ */
+struct LargeHeader {
+    unsigned int blockSize;     // always LARGE_BLOCK, shares its offset with PageHeader::blockSize and ChunkHeader::kind
+    unsigned int offset;        // bytes from the start of the span to the block, LARGE_OFFSET unless aligned further
+    size_t spanSize;            // bytes mapped for this span, including this header
+    void *nextSpan;
+    void *prevSpan;
+    unsigned int sampled;       // nonzero while the block is a sample of the heap profiler, see sampleAlloc()
+};
+
+/*
+ * Defines a block sampled by the heap profiler, kept LARGE_OFFSET bytes into its span right after the LargeHeader.
+ * Live samples are linked in samples, protected by profileLock.
+ */
+struct Sample {
+    Sample *nextSample;
+    Sample *prevSample;
+    size_t size;                // bytes requested
+    unsigned int depth;         // frames in stack
+    void *stack[PROFILE_DEPTH]; // return addresses, innermost first
+};
+
+/*
+ * Defines the bookkeeping at the head of a chunk of pages.
+ */
+struct ChunkHeader {
+    unsigned int kind;                  // always SMALL_CHUNK, shares its offset with LargeHeader::blockSize
+    unsigned int pagesFree;             // number of free pages in this chunk
+    void *nextChunk;
+    void *prevChunk;
+    unsigned int pagesDirty;            // number of free pages not yet returned to the OS
+    unsigned int node;                  // NUMA node this chunk is bound to and pooled with
+    uint64_t dirtySince;                // time in ms this chunk's oldest dirty page was freed
+    uint64_t freeMap[CHUNK_PAGES / 64]; // bit set for every free page
+    uint64_t dirtyMap[CHUNK_PAGES / 64];// bit set for every free page not yet returned to the OS
+    PageHeader *spans[CHUNK_PAGES];     // header of the span holding each page in use
+#ifdef PG_HEADER_TABLE
+    PageHeader headers[CHUNK_PAGES];    // header of each span, by its first page
+#endif
+};
+
+/*
+ * Defines the chunks of one NUMA node, see allocSpan().
+ */
+struct NodePool {
+    void *chunks;               // chunks of this node with free pages
+    size_t chunkCount;          // chunks mapped for this node
+    size_t pagesFree;           // free pages in those chunks
+};
+
+/*
+ * Defines the bookkeeping at the head of every span of an arena but the first, see pgarena_alloc().
+ */
+struct ArenaSpan {
+    ArenaSpan *nextSpan;
+    unsigned int pages;         // pages in this span
+};
+
+/*
+ * Defines an arena, kept at the head of its first span.
+ */
+struct PgArena {
+    char *bump;                 // next free byte in the current span
+    char *end;                  // end of the current span
+    ArenaSpan *spans;           // spans after the first, newest first, changed under chunkLock for pgwalk()
+    void *large;                // blocks too large for a span, linked through their first word
+    PgArena *prevArena;         // previous live arena, see arenas
+    PgArena *nextArena;         // next live arena
+};
+
+/*
+ * Defines the bookkeeping of a file heap, kept in the file right after the ChunkHeader of its first chunk.
+ * Everything in it stays valid across processes since the file is always mapped at the same address.
+ * In the chunks of a file dirtyMap marks the free pages that have held blocks before, as they are never purged.
+ */
+struct FileHeader {
+    uint64_t magic;             // FILE_MAGIC
+    uintptr_t base;             // address the file is mapped at
+    size_t size;                // bytes in the file
+    unsigned int chunks;        // chunks in the file
+    unsigned int clean;         // nonzero while the file matches its last pgfile_sync()
+    unsigned int pageSize;      // PAGE_SIZE, SIZE_CLASSES, SIZE_CLASS_MAX and the sizes below describe the layout
+    unsigned int classes;
+    unsigned int classMax;
+    unsigned int pageHeader;    // sizeof(PageHeader)
+    unsigned int chunkHeader;   // sizeof(ChunkHeader)
+    unsigned int heapSize;      // sizeof(Heap)
+    void *root;                 // see pgfile_root()
+    Heap heap;                  // pages and full pages of the file
+};
+
+/*
+ * Defines the handle of an open file heap, see pgfile_open().
+ */
+struct PgFile {
+    FileHeader *header;
+    ChunkHeader *base;          // first chunk of the mapping
+    size_t size;
+    int fd;
+    PgFile *nextFile;
+    PgFile *prevFile;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Defines an object cache, see pgcache_create().
+ * Its pages belong to a heap of its own, shared by every thread under the cache's lock.
+ */
+struct PgCache {
+    Heap *heap;                 // pages of this cache
+    unsigned int index;         // size class of its blocks
+    unsigned int offset;        // bytes from the start of a block to its object, keeps the free list link out of constructed objects
+    size_t objSize;
+    unsigned int keepPages;     // empty pages kept for reuse, see pgcache_reserve()
+    void (*ctor)(void *);
+    void (*dtor)(void *);
+    PgCache *nextCache;
+    PgCache *prevCache;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Pages at the front of each chunk holding its ChunkHeader.
+ */
+#define CHUNK_META_PAGES ((sizeof(ChunkHeader) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/*
+ * Pages after the ChunkHeader of the first chunk of a file heap holding its FileHeader.
+ */
+#define FILE_META_PAGES  ((sizeof(FileHeader) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/*
+ * Bytes at the start of each span taken by its PageHeader.
+ */
+#ifdef PG_HEADER_TABLE
+#define SPAN_HEADER      0
+#else
+#define SPAN_HEADER      sizeof(PageHeader)
+#endif
+
+_Static_assert(sizeof(LargeHeader) <= LARGE_OFFSET, "LargeHeader must fit in front of the block");
+_Static_assert(LARGE_OFFSET % SIZE_CLASS_ALIGN == 0, "large blocks must be aligned like small ones");
+_Static_assert(offsetof(LargeHeader, blockSize) == offsetof(ChunkHeader, kind), "chunk kind must share an offset");
+_Static_assert(LARGE_BLOCK != SMALL_CHUNK, "chunk kinds must differ");
+_Static_assert(LARGE_OFFSET + sizeof(Sample) <= SAMPLE_OFFSET, "Sample must fit in front of the block");
+_Static_assert((SAMPLE_OFFSET & (SAMPLE_OFFSET - 1)) == 0 && SAMPLE_OFFSET <= LARGE_ALIGN_MAX, "samples are aligned blocks");
+_Static_assert(PG_FILE_ALIGN == CHUNK_SIZE, "file heaps are made of chunks");
+_Static_assert(CHUNK_META_PAGES + FILE_META_PAGES + MAX_SPAN_PAGES <= CHUNK_PAGES, "a FileHeader must leave room for a span");
+_Static_assert(sizeof(PgArena) <= ARENA_HEADER && sizeof(ArenaSpan) <= ARENA_HEADER, "arena bookkeeping must fit its header");
+_Static_assert(ARENA_HEADER % SIZE_CLASS_ALIGN == 0, "arena blocks must be aligned like pgalloc() blocks");
+_Static_assert(offsetof(LargeHeader, blockSize) == offsetof(PageHeader, blockSize), "page kind must share an offset");
+
+/*
+ * Live large spans and freed spans kept for reuse, indexed by spanIndex().
+ * Protected by largeLock.
+ */
+static void *largeSpans = NULL;
+static void *spanCache[LARGE_CACHE_CLASSES] = { NULL };
+static size_t spanCacheBytes = 0;
+static size_t spanCacheCount = 0;
+
+/*
+ * Statistics for large spans, see pgstats(). Protected by largeLock.
+ */
+static size_t largeCount = 0;
+static size_t largeBytes = 0;
+static uint64_t largeAllocs = 0;
+static uint64_t largeFrees = 0;
+static pthread_mutex_t largeLock = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(SIZE_CLASS_PAGE == PAGE_SIZE, "scripts/sizeclasses is out of date");
+_Static_assert(SIZE_CLASS_HEADER == SPAN_HEADER, "scripts/sizeclasses is out of date");
+_Static_assert(SIZE_CLASSES <= PG_STATS_CLASSES, "pgstats() cannot report every size class");
+_Static_assert(NUMA_NODES <= sizeof(unsigned long) * CHAR_BIT, "a node must fit the mbind() node mask");
+_Static_assert((MAX_SPAN_PAGES * PAGE_SIZE) / 8 <= USHRT_MAX, "PageHeader::blocksUsed is too narrow");
+
+/*
+ * pgalloc_inline() works on the leading fields of PageHeader and Heap through the mirrors in pgalloc.h.
+ */
+_Static_assert(PG_SIZE_CLASSES == SIZE_CLASSES, "pgalloc.h is out of date");
+_Static_assert(PG_SIZE_CLASS(SIZE_CLASS_MAX) == SIZE_CLASSES - 1 && PG_SIZE_CLASS(SMALL_INDEX_MAX) == 20, "PG_SIZE_CLASS() is out of date");
+#if !defined(PG_BITMAP_PAGES) && !defined(PG_HEADER_TABLE)
+_Static_assert(PG_SMALL_MAX == SIZE_CLASS_MAX, "pgalloc.h is out of date");
+_Static_assert(PG_PAGE_HEADER == sizeof(PageHeader), "PgFastPage must mirror PageHeader");
+#endif
+_Static_assert(offsetof(PgFastPage, blocksUsed) == offsetof(PageHeader, blocksUsed) && offsetof(PgFastPage, freeList) == offsetof(PageHeader, freeList)
+        && offsetof(PgFastPage, avl) == offsetof(PageHeader, avl), "PgFastPage must mirror PageHeader");
+_Static_assert(sizeof(PgFastStats) == sizeof(ClassStats) && offsetof(PgFastStats, allocs) == offsetof(ClassStats, allocs)
+        && offsetof(PgFastStats, requested) == offsetof(ClassStats, requested), "PgFastStats must mirror ClassStats");
+_Static_assert(offsetof(PgFastHeap, remotePages) == offsetof(Heap, remotePages) && offsetof(PgFastHeap, pages) == offsetof(Heap, pages)
+        && offsetof(PgFastHeap, stats) == offsetof(Heap, stats), "PgFastHeap must mirror Heap");
+
+/*
+ * Chunks with free pages and the decay policy for them, protected by chunkLock.
+ * oldestDirty is the time in ms the oldest page not yet returned to the OS was freed, or 0 if there is none.
+ */
+static NodePool nodePools[NUMA_NODES];
+static unsigned int dirtyPages = 0;
+static uint64_t oldestDirty = 0;
+static unsigned int decayMs = DECAY_MS;
+static unsigned int maxDirtyPages = DIRTY_PAGES_MAX;
+static pthread_mutex_t chunkLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every live arena, so pgwalk() can list their spans. Protected by chunkLock like the spans of each arena.
+ */
+static PgArena *arenas = NULL;
+
+/*
+ * Used to track the largest data that can be stored in a single page
+ */
+static unsigned int maxPageData = SIZE_CLASS_MAX;
+
+
+/*
+ * Heap owned by the calling thread.
+ * The initial-exec model keeps the first access from a thread from allocating when the library is used as malloc().
+ */
+static _Thread_local Heap *localHeap __attribute__((tls_model("initial-exec"))) = NULL;
+
+/*
+ * NUMA node set for the calling thread with pgnode(), or -1 to take pages from the node it runs on.
+ */
+static _Thread_local int localNode __attribute__((tls_model("initial-exec"))) = -1;
+
+/*
+ * Number of NUMA nodes the machine may have, read once from NODE_POSSIBLE. With a single node
+ * every chunk is left to the kernel's default placement.
+ */
+static unsigned int numaNodes = 1;
+static pthread_once_t numaOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * The same heap as seen by pgalloc_inline(), kept in step with localHeap.
+ */
+extern _Thread_local PgFastHeap *pgFastHeap __attribute__((tls_model("initial-exec")));
+_Thread_local PgFastHeap *pgFastHeap = NULL;
+
+/*
+ * Bytes the calling thread may still allocate before sampleAlloc() is called, also counted down by pgalloc_inline().
+ */
+extern _Thread_local size_t pgSampleLeft __attribute__((tls_model("initial-exec")));
+_Thread_local size_t pgSampleLeft = 0;
+
+/*
+ * Average bytes between samples the calling thread drew pgSampleLeft for, and the state of its random numbers.
+ */
+static _Thread_local size_t localRate __attribute__((tls_model("initial-exec"))) = 0;
+static _Thread_local uint64_t localSeed __attribute__((tls_model("initial-exec"))) = 0;
+
+/*
+ * Heap profiler, see pgprofile(). samples is protected by profileLock, which is taken after every other lock but traceLock.
+ */
+static _Atomic(size_t) profileRate = 0;
+static _Atomic(size_t) profileLast = PROFILE_RATE;  // last rate set, which a profile reports after the profiler stops
+static Sample *samples = NULL;
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static const char *profilePath = NULL;
+
+/*
+ * Shared pool holding the pages of threads that have exited.
+ * Pages still holding blocks stay in the pool until those blocks are freed, pages with no
+ * blocks in use go back to their chunk where any thread may pick them up in newPage().
+ * Everything below is protected by poolLock.
+ */
+static Heap pool;
+static Heap *freeHeaps = NULL;
+static Heap *cacheHeaps = NULL;     // heaps of destroyed caches, which own no pages and are only handed to new caches
+static Heap *allHeaps = NULL;
+static char *heapSlab = NULL;
+static size_t heapSlabLeft = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every live cache, so a fork can take their locks. Protected by cacheLock, which is taken before the lock of any cache.
+ */
+static PgCache *caches = NULL;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every open file heap, so a fork can take their locks. Protected by fileLock, which is taken before the lock of any file heap.
+ */
+static PgFile *files = NULL;
+static pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * REGION_* kind of every CHUNK_SIZE region, 2 bits each, mapped on first use.
+ */
+static _Atomic(_Atomic(uint64_t) *) regionMap = NULL;
+
+#ifdef PG_TRACE
+/*
+ * Trace being recorded, see pgtrace(). traceFd, traceStart and traceBuffer are protected by traceLock, which is taken
+ * after every other lock. Each thread is numbered on its first traced call.
+ */
+static atomic_int tracing = 0;
+static int traceFd = -1;
+static uint64_t traceStart = 0;
+static PgTraceRecord traceBuffer[TRACE_RECORDS];
+static unsigned int traceCount = 0;
+static atomic_uint traceThreads = 0;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local uint32_t localThread __attribute__((tls_model("initial-exec"))) = 0;
+#endif
+
+/*
+ * Used to run releaseHeap() on thread exit.
+ */
+static pthread_key_t heapKey;
+static pthread_once_t heapKeyOnce = PTHREAD_ONCE_INIT;
+static int heapKeyValid = 0;
+
+/*
+ * Mainly used as a way to get a pointer to front
+ * of the chunk given a pointer to an arbitrary point
+ * in the chunk. See getPage().
+ */
+static uintptr_t chunkMask = ~((uintptr_t) (CHUNK_SIZE - 1));
+
+static unsigned int getPageIndex(unsigned int byteRequest)
+{
+    unsigned int i = 0;
+
+    assert(byteRequest <= SIZE_CLASS_MAX);
+
+    if (byteRequest <= SMALL_INDEX_MAX) {
+        i = smallIndex[(byteRequest + (1 << SMALL_INDEX_SHIFT) - 1) >> SMALL_INDEX_SHIFT];
+    } else {
+        i = largeIndex[(byteRequest + (1 << LARGE_INDEX_SHIFT) - 1) >> LARGE_INDEX_SHIFT];
+    }
+
+    assert(i < SIZE_CLASSES);
+    return i;
+}
+
+void pgfree(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    traceEvent(PG_TRACE_FREE, ptr, 0);
+
+    void *page = getPage(ptr);
+    PageHeader *ph = (PageHeader *)page;
+
+    if (isLargePage(page)) {
+        largeFree(page);
+        return;
+    }
+
+    Heap *heap = atomic_load_explicit(&(ph->owner), memory_order_relaxed);
+
+    if (heap == localHeap) {
+        recycleBlock(heap, page, ptr);
+        return;
+    }
+
+    // a file heap only changes under its lock, once its clean mark is cleared
+    if (heap->file) {
+        pgfile_free(heap->file, ptr);
+        return;
+    }
+
+    if (heap->cache) {
+        pgcache_free(heap->cache, ptr);
+        return;
+    }
+
+    remoteFree(heap, page, ptr, ptr);
+}
+
+void pgfree_bulk(void **ptrs, size_t num)
+{
+    void *pages[BULK_PAGES] = { NULL };
+    void *first[BULK_PAGES];
+    void *last[BULK_PAGES];
+    unsigned int next = 0;
+
+    for (size_t i = 0; i < num; i++) {
+        void *ptr = ptrs[i];
+
+        if (!ptr) {
+            continue;
+        }
+
+        traceEvent(PG_TRACE_FREE, ptr, 0);
+
+        void *page = getPage(ptr);
+
+        if (isLargePage(page)) {
+            largeFree(page);
+            continue;
+        }
+
+        unsigned int g = 0;
+
+        while (g < BULK_PAGES && pages[g] != page) {
+            g++;
+        }
+
+        if (g < BULK_PAGES) {
+            *((uintptr_t *)ptr) = (uintptr_t) first[g];
+            first[g] = ptr;
+            continue;
+        }
+
+        // take over the slot of the page seen longest ago
+        g = next;
+        next = (next + 1) % BULK_PAGES;
+
+        if (pages[g]) {
+            freeBlocks(pages[g], first[g], last[g]);
+        }
+
+        *((uintptr_t *)ptr) = (uintptr_t) NULL;
+        pages[g] = page;
+        first[g] = ptr;
+        last[g] = ptr;
+    }
+
+    for (unsigned int g = 0; g < BULK_PAGES; g++) {
+        if (pages[g]) {
+            freeBlocks(pages[g], first[g], last[g]);
+        }
+    }
+}
+
+static void freeBlocks(void *page, void *first, void *last)
+{
+    PageHeader *ph = (PageHeader *)page;
+    Heap *heap = atomic_load_explicit(&(ph->owner), memory_order_relaxed);
+
+    if (heap == localHeap) {
+        recycleBlocks(heap, page, first);
+        return;
+    }
+
+    if (heap->file) {
+        PgFile *file = heap->file;
+
+        pthread_mutex_lock(&(file->lock));
+        touchFile(file);
+        recycleBlocks(heap, page, first);
+        pthread_mutex_unlock(&(file->lock));
+        return;
+    }
+
+    // the chain is linked through the first word of each object, which a cache keeps constructed
+    assert(!heap->cache);
+
+    remoteFree(heap, page, first, last);
+}
+
+static void remoteFree(Heap *heap, void *page, void *first, void *last)
+{
+    PageHeader *ph = (PageHeader *)page;
+    void *head = atomic_load_explicit(&(ph->remoteFree), memory_order_relaxed);
+
+    do {
+        *((uintptr_t *)last) = (uintptr_t) head;
+    } while (!atomic_compare_exchange_weak_explicit(&(ph->remoteFree), &head, first,
+                memory_order_acq_rel, memory_order_relaxed));
+
+    if (head != NULL) {
+        // page is already queued on the owning heap
+        return;
+    }
+
+    /*
+     * Only the thread that found the list empty queues the page, and the owner only empties
+     * the list after taking the page off remotePages, so a page is never queued twice.
+     */
+    void *headPage = atomic_load_explicit(&(heap->remotePages), memory_order_relaxed);
+
+    do {
+        ph->remoteNext = headPage;
+    } while (!atomic_compare_exchange_weak_explicit(&(heap->remotePages), &headPage, page,
+                memory_order_release, memory_order_relaxed));
+}
+
+static void collectRemote(Heap *heap)
+{
+    void *page = atomic_exchange_explicit(&(heap->remotePages), NULL, memory_order_acquire);
+
+    while (page) {
+        PageHeader *ph = (PageHeader *)page;
+
+        // must be read before emptying remoteFree, which lets other threads queue the page again
+        void *next = ph->remoteNext;
+        void *blocks = atomic_exchange_explicit(&(ph->remoteFree), NULL, memory_order_acq_rel);
+
+        if (atomic_load_explicit(&(ph->owner), memory_order_relaxed) == heap) {
+            recycleBlocks(heap, page, blocks);
+            if (heap == &pool) {
+                releasePoolPage(page);
+            }
+        } else {
+            /*
+             * Queued on this heap while its previous thread was exiting, the page has since
+             * moved to the shared pool.
+             */
+            assert(atomic_load_explicit(&(ph->owner), memory_order_relaxed) == &pool);
+
+            pthread_mutex_lock(&poolLock);
+            recycleBlocks(&pool, page, blocks);
+            releasePoolPage(page);
+            pthread_mutex_unlock(&poolLock);
+        }
+
+        page = next;
+    }
+}
+
+static void collectPool(void)
+{
+    if (atomic_load_explicit(&(pool.remotePages), memory_order_relaxed)) {
+        collectRemote(&pool);
+    }
+
+    for (Heap *heap = freeHeaps; heap; heap = heap->nextHeap) {
+        void *page = atomic_exchange_explicit(&(heap->remotePages), NULL, memory_order_acquire);
+
+        // every page left on a released heap has moved to the pool, unless it was full and off the list, see PG_NO_FULL_LIST
+        while (page) {
+            PageHeader *ph = (PageHeader *)page;
+            void *next = ph->remoteNext;
+            void *blocks = atomic_exchange_explicit(&(ph->remoteFree), NULL, memory_order_acq_rel);
+
+            if (atomic_load_explicit(&(ph->owner), memory_order_relaxed) == heap) {
+                unsigned int i = getPageIndex(ph->blockSize);
+
+                atomic_store_explicit(&(ph->owner), &pool, memory_order_relaxed);
+                removeFullList(heap, page);
+                addFullList(&pool, page);
+                countSub(&(heap->stats[i].pages), 1);
+                countAdd(&(pool.stats[i].pages), 1);
+            }
+
+            recycleBlocks(&pool, page, blocks);
+            releasePoolPage(page);
+
+            page = next;
+        }
+    }
+}
+
+static void releasePoolPage(void *page)
+{
+    PageHeader *ph = (PageHeader *)page;
+
+    if (ph->blocksUsed == 0) {
+        // last block of an orphaned page; make the page available to any thread
+        unlinkPage(availList(&pool, page), page);
+        dropPage(&pool, page);
+    }
+}
+
+static void recycleBlocks(Heap *heap, void *page, void *blocks)
+{
+    PageHeader *ph = (PageHeader *)page;
+    void *tail = blocks;
+    unsigned int num = 1;
+
+    if (!blocks) {
+        return;
+    }
+
+    int wasFull = (blocksPerPage(page) == ph->blocksUsed);
+
+#ifdef PG_BITMAP_PAGES
+    clearBlock(page, tail);
+#endif
+    while (*((uintptr_t *)tail)) {
+        tail = (void *) *((uintptr_t **)tail);
+        num++;
+#ifdef PG_BITMAP_PAGES
+        clearBlock(page, tail);
+#endif
+    }
+
+    if (wasFull) {
+        removeFullList(heap, page);
+    }
+
+#ifndef PG_BITMAP_PAGES
+    *((uintptr_t *)tail) = (uintptr_t) (ph->freeList);
+    ph->freeList = blocks;
+#endif
+
+    assert(ph->blocksUsed >= num);
+    ph->blocksUsed -= num;
+    countAdd(&(heap->stats[getPageIndex(ph->blockSize)].frees), num);
+
+    if (wasFull && ph->blocksUsed) {
+        parkPage(heap, page);
+    } else if (wasFull) {
+        // about to be retired, or kept as the only page of its class
+        pushPage(&(heap->pages[getPageIndex(ph->blockSize)]), page);
+    }
+
+    if (ph->blocksUsed == 0 && heap != &pool) {
+        retirePage(heap, page);
+    }
+}
+
+static void retirePage(Heap *heap, void *page)
+{
+    PageHeader *ph = (PageHeader *)page;
+    unsigned int i = getPageIndex(ph->blockSize);
+
+    if (heap->pages[i] == page && ph->nextPage == NULL) {
+        // keep serving allocations from it rather than bouncing it between lists
+        return;
+    }
+
+    unlinkPage(availList(heap, page), page);
+    ph->flags &= PAGE_FLAGS_MASK;
+
+    if (heap->emptyCount[i] < (heap->cache ? heap->cache->keepPages : EMPTY_CACHE)) {
+        pushPage(&(heap->emptyPages[i]), page);
+        heap->emptyCount[i]++;
+    } else {
+        dropPage(heap, page);
+    }
+}
+
+static void releaseEmptyPages(Heap *heap)
+{
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        while (heap->emptyPages[i]) {
+            void *page = heap->emptyPages[i];
+
+            unlinkPage(&(heap->emptyPages[i]), page);
+            dropPage(heap, page);
+        }
+        heap->emptyCount[i] = 0;
+
+        void *page = heap->pages[i];
+
+        while (page) {
+            void *next = ((PageHeader *)page)->nextPage;
+
+            if (((PageHeader *)page)->blocksUsed == 0) {
+                unlinkPage(&(heap->pages[i]), page);
+                dropPage(heap, page);
+            }
+            page = next;
+        }
+    }
+}
+
+static void recycleBlock(Heap *heap, void *page, void *ptr)
+{
+    PageHeader *ph = (PageHeader *)page;
+    int wasFull = (blocksPerPage(page) == ph->blocksUsed);
+
+    if (wasFull) {
+        removeFullList(heap, page);
+    }
+
+#ifdef PG_BITMAP_PAGES
+    clearBlock(page, ptr);
+#else
+    if ((ph->freeList) != NULL) {
+        *((uintptr_t *)ptr) = (uintptr_t) (ph->freeList);
+    } else {
+        *((uintptr_t *)ptr) = (uintptr_t) NULL;
+    }
+
+    ph->freeList = &(*((uintptr_t *)ptr));
+
+    // ph->freeList should never be NULL at this point
+    assert(ph->freeList);
+#endif
+    (ph->blocksUsed)--;
+    countAdd(&(heap->stats[getPageIndex(ph->blockSize)].frees), 1);
+
+    if (wasFull && ph->blocksUsed) {
+        parkPage(heap, page);
+    } else if (wasFull) {
+        // about to be retired, or kept as the only page of its class
+        pushPage(&(heap->pages[getPageIndex(ph->blockSize)]), page);
+    }
+
+    if (ph->blocksUsed == 0) {
+        retirePage(heap, page);
+    }
+}
+
+static void parkPage(Heap *heap, void *page)
+{
+    PageHeader *ph = (PageHeader *)page;
+    unsigned int bucket = pageBucket(page);
+
+    if (ph->flags >> PAGE_BUCKET_SHIFT) {
+        unlinkPage(availList(heap, page), page);
+    }
+
+    pushPage(&(heap->partialPages[getPageIndex(ph->blockSize)][bucket]), page);
+    ph->flags = (unsigned short)((ph->flags & PAGE_FLAGS_MASK) | ((bucket + 1) << PAGE_BUCKET_SHIFT));
+}
+
+static void *unparkPage(Heap *heap, unsigned int index)
+{
+    for (unsigned int b = PARTIAL_BUCKETS; b-- > 0;) {
+        void *page;
+
+        while ((page = heap->partialPages[index][b])) {
+            if (pageBucket(page) < b) {
+                parkPage(heap, page);
+                continue;
+            }
+
+            unlinkPage(&(heap->partialPages[index][b]), page);
+            ((PageHeader *)page)->flags &= PAGE_FLAGS_MASK;
+            pushPage(&(heap->pages[index]), page);
+
+            return page;
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned int pageBucket(void *page)
+{
+    // PARTIAL_BUCKETS comparisons rather than a division
+    unsigned int used = ((PageHeader *)page)->blocksUsed * PARTIAL_BUCKETS;
+    unsigned int max = blocksPerPage(page);
+    unsigned int bucket = 0;
+
+    while (bucket < PARTIAL_BUCKETS - 1 && used >= (bucket + 1) * max) {
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static void **availList(Heap *heap, void *page)
+{
+    PageHeader *ph = (PageHeader *)page;
+    unsigned int i = getPageIndex(ph->blockSize);
+    unsigned int parked = ph->flags >> PAGE_BUCKET_SHIFT;
+
+    return parked ? &(heap->partialPages[i][parked - 1]) : &(heap->pages[i]);
+}
+
+static void *getPage(void *ptr)
+{
+    ChunkHeader *chunk = (ChunkHeader *) ((((uintptr_t) ptr) & chunkMask));
+
+    if (chunk->kind == LARGE_BLOCK) {
+        // the chunk is a large span and its LargeHeader is the page
+        return chunk;
+    }
+
+    void *page = chunk->spans[(((uintptr_t) ptr) - ((uintptr_t) chunk)) >> PAGE_SHIFT];
+    return page;
+}
+
+static int isLargePage(void *page)
+{
+    return ((PageHeader *)page)->blockSize == LARGE_BLOCK;
+}
+
+static int markRegion(void *base, unsigned int kind)
+{
+    uintptr_t region = ((uintptr_t)base) >> CHUNK_SHIFT;
+    _Atomic(uint64_t) *map = atomic_load_explicit(&regionMap, memory_order_acquire);
+
+    if (region >= REGIONS) {
+        return 0;
+    }
+
+    if (!map) {
+        // untouched parts of the map cost nothing, so it is mapped in one go
+        _Atomic(uint64_t) *expected = NULL;
+
+        map = mmap(NULL, REGION_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            return 0;
+        }
+
+        if (!atomic_compare_exchange_strong_explicit(&regionMap, &expected, map, memory_order_acq_rel, memory_order_acquire)) {
+            // another thread got there first
+            munmap((void *)map, REGION_MAP_SIZE);
+            map = expected;
+        }
+    }
+
+    unsigned int shift = (unsigned int)(region % 32) * 2;
+
+    if (kind == REGION_NONE) {
+        atomic_fetch_and_explicit(&map[region / 32], ~(((uint64_t)3) << shift), memory_order_release);
+    } else {
+        atomic_fetch_or_explicit(&map[region / 32], ((uint64_t)kind) << shift, memory_order_release);
+    }
+
+    return 1;
+}
+
+static unsigned int regionKind(const void *ptr)
+{
+    uintptr_t region = ((uintptr_t)ptr) >> CHUNK_SHIFT;
+    _Atomic(uint64_t) *map = atomic_load_explicit(&regionMap, memory_order_acquire);
+
+    if (!map || region >= REGIONS) {
+        return REGION_NONE;
+    }
+
+    uint64_t word = atomic_load_explicit(&map[region / 32], memory_order_acquire);
+
+    return (unsigned int)(word >> ((region % 32) * 2)) & 3;
+}
+
+static void *mapPages(size_t size, size_t align)
+{
+    if (size > SIZE_MAX - align) {
+        return NULL;
+    }
+
+    /*
+     * Map enough to find an aligned run of the requested size and hand the rest back.
+     */
+    size_t len = size + align - OS_PAGE_SIZE;
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t)mem;
+    uintptr_t aligned = (start + align - 1) & ~((uintptr_t)align - 1);
+    size_t head = aligned - start;
+    size_t tail = len - head - size;
+
+    if (head) {
+        munmap(mem, head);
+    }
+    if (tail) {
+        munmap((void *)(aligned + size), tail);
+    }
+
+    return (void *)aligned;
+}
+
+static size_t spanSize(size_t bytes)
+{
+    if (bytes > SIZE_MAX - LARGE_OFFSET - PAGE_SIZE) {
+        return 0;
+    }
+
+    size_t size = bytes + LARGE_OFFSET;
+
+    if (size > LARGE_CACHE_MAX) {
+        // too big to cache, only round to whole pages
+        return (size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+    }
+
+    // four sizes per doubling, in steps no smaller than an OS page
+    size_t step = ((size_t)1 << (63 - __builtin_clzll(size - 1))) / 4;
+
+    if (step < OS_PAGE_SIZE) {
+        step = OS_PAGE_SIZE;
+    }
+
+    size = (size + step - 1) & ~(step - 1);
+
+    return size < (PAGE_SIZE + OS_PAGE_SIZE) ? (PAGE_SIZE + OS_PAGE_SIZE) : size;
+}
+
+static unsigned int spanIndex(size_t size)
+{
+    if (size <= 2 * PAGE_SIZE) {
+        return (size / OS_PAGE_SIZE) - 3;
+    }
+
+    unsigned int lg = 63 - __builtin_clzll(size - 1);
+    size_t step = ((size_t)1 << lg) / 4;
+    unsigned int pos = ((size - ((size_t)1 << lg)) / step) - 1;
+
+    return 2 + ((lg - 14) * 4) + pos;
+}
+
+static void *largeAlloc(size_t bytes, size_t align, int *zeroed)
+{
+    // the block stays within the first chunk of the span so getPage() still finds the header
+    size_t offset = align > LARGE_OFFSET ? align : LARGE_OFFSET;
+    size_t size = 0;
+    void *span = NULL;
+
+    if (bytes > SIZE_MAX - offset) {
+        return NULL;
+    }
+
+    size = spanSize(bytes + (offset - LARGE_OFFSET));
+    if (size == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&largeLock);
+
+    if (size <= LARGE_CACHE_MAX) {
+        unsigned int i = spanIndex(size);
+
+        span = spanCache[i];
+        if (span) {
+            unlinkSpan(&spanCache[i], span);
+            spanCacheBytes -= size;
+            spanCacheCount--;
+        }
+    }
+
+    pthread_mutex_unlock(&largeLock);
+
+    if (!span) {
+        /*
+         * Aligned on CHUNK_SIZE to make chunkMask work in getPage()
+         */
+        span = mapPages(size, CHUNK_SIZE);
+        if (!span) {
+            return NULL;
+        }
+
+        if (!markRegion(span, REGION_LARGE)) {
+            munmap(span, size);
+            return NULL;
+        }
+
+        if (zeroed) {
+            *zeroed = 1;
+        }
+    } else if (zeroed) {
+        // a cached span still holds whatever its last block held
+        *zeroed = 0;
+    }
+
+    LargeHeader *lh = (LargeHeader *)span;
+
+    lh->blockSize = LARGE_BLOCK;
+    lh->offset = (unsigned int)offset;
+    lh->spanSize = size;
+    lh->sampled = 0;
+
+    pthread_mutex_lock(&largeLock);
+    pushSpan(&largeSpans, span);
+    largeCount++;
+    largeBytes += size;
+    largeAllocs++;
+    pthread_mutex_unlock(&largeLock);
+
+    return (void *)((uintptr_t)span + offset);
+}
+
+static void largeFree(void *span)
+{
+    LargeHeader *lh = (LargeHeader *)span;
+    size_t size = lh->spanSize;
+
+    if (lh->sampled) {
+        dropSample(span);
+    }
+
+    pthread_mutex_lock(&largeLock);
+
+    unlinkSpan(&largeSpans, span);
+    largeCount--;
+    largeBytes -= size;
+    largeFrees++;
+
+    if (size <= LARGE_CACHE_MAX && spanCacheBytes + size <= LARGE_CACHE_BYTES) {
+        pushSpan(&spanCache[spanIndex(size)], span);
+        spanCacheBytes += size;
+        spanCacheCount++;
+    } else {
+        unmapSpan(span);
+    }
+
+    pthread_mutex_unlock(&largeLock);
+}
+
+static void unmapSpan(void *span)
+{
+    // pgowns() checks large regions under largeLock, so the region is never seen marked once unmapped
+    markRegion(span, REGION_NONE);
+    munmap(span, ((LargeHeader *)span)->spanSize);
+}
+
+static void pushSpan(void **list, void *span)
+{
+    LargeHeader *lh = (LargeHeader *)span;
+    LargeHeader *headSpan = (LargeHeader *)*list;
+
+    lh->prevSpan = NULL;
+    lh->nextSpan = headSpan;
+
+    if (headSpan) {
+        headSpan->prevSpan = span;
+    }
+
+    *list = span;
+}
+
+static void unlinkSpan(void **list, void *span)
+{
+    LargeHeader *lh = (LargeHeader *)span;
+    LargeHeader *nlh = (LargeHeader *)lh->nextSpan;
+    LargeHeader *plh = (LargeHeader *)lh->prevSpan;
+
+    if (plh != NULL) {
+        plh->nextSpan = lh->nextSpan;
+    } else {
+        *list = lh->nextSpan;
+    }
+
+    if (nlh != NULL) {
+        nlh->prevSpan = lh->prevSpan;
+    }
+
+    lh->prevSpan = NULL;
+    lh->nextSpan = NULL;
+}
+
+/*
+ * Registers the fork handlers once the library is loaded, after which pthread_atfork() may safely allocate.
+ */
+__attribute__((constructor)) static void registerFork(void)
+{
+    pthread_atfork(lockAll, unlockAll, forkChild);
+
+    profilePath = getenv(PROFILE_ENV);
+    if (profilePath && *profilePath) {
+        pgprofile(PROFILE_RATE);
+    }
+
+#ifdef PG_TRACE
+    const char *path = getenv(TRACE_ENV);
+
+    if (path && *path) {
+        pgtrace(path);
+    }
+#endif
+}
+
+__attribute__((destructor)) static void endProfile(void)
+{
+    if (profilePath && *profilePath) {
+        pgprofile_dump(profilePath);
+    }
+}
+
+#ifdef PG_TRACE
+__attribute__((destructor)) static void endTrace(void)
+{
+    pgtrace(NULL);
+}
+#endif
+
+static void lockAll(void)
+{
+    pthread_mutex_lock(&cacheLock);
+    for (PgCache *cache = caches; cache; cache = cache->nextCache) {
+        pthread_mutex_lock(&(cache->lock));
+    }
+
+    pthread_mutex_lock(&fileLock);
+    for (PgFile *file = files; file; file = file->nextFile) {
+        pthread_mutex_lock(&(file->lock));
+    }
+
+    pthread_mutex_lock(&poolLock);
+    pthread_mutex_lock(&chunkLock);
+    pthread_mutex_lock(&largeLock);
+    pthread_mutex_lock(&profileLock);
+#ifdef PG_TRACE
+    pthread_mutex_lock(&traceLock);
+#endif
+}
+
+static void unlockAll(void)
+{
+#ifdef PG_TRACE
+    pthread_mutex_unlock(&traceLock);
+#endif
+    pthread_mutex_unlock(&profileLock);
+    pthread_mutex_unlock(&largeLock);
+    pthread_mutex_unlock(&chunkLock);
+    pthread_mutex_unlock(&poolLock);
+
+    for (PgFile *file = files; file; file = file->nextFile) {
+        pthread_mutex_unlock(&(file->lock));
+    }
+    pthread_mutex_unlock(&fileLock);
+
+    for (PgCache *cache = caches; cache; cache = cache->nextCache) {
+        pthread_mutex_unlock(&(cache->lock));
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static void forkChild(void)
+{
+#ifdef PG_TRACE
+    if (traceFd >= 0) {
+        // the buffered records are the parent's to write
+        close(traceFd);
+        traceFd = -1;
+        traceCount = 0;
+        atomic_store_explicit(&tracing, 0, memory_order_relaxed);
+    }
+#endif
+    unlockAll();
+}
+
+static void createHeapKey(void)
+{
+    if (pthread_key_create(&heapKey, releaseHeap) == 0) {
+        heapKeyValid = 1;
+    }
+}
+
+static Heap *getHeap(void)
+{
+    Heap *heap = localHeap;
+
+    if (heap) {
+        return heap;
+    }
+
+    pthread_once(&heapKeyOnce, createHeapKey);
+
+    pthread_mutex_lock(&poolLock);
+    heap = takeHeap();
+    pthread_mutex_unlock(&poolLock);
+
+    if (!heap) {
+        return NULL;
+    }
+
+    if (heapKeyValid) {
+        // registers releaseHeap() to run when this thread exits
+        pthread_setspecific(heapKey, heap);
+    }
+
+    localHeap = heap;
+#if !defined(PG_BITMAP_PAGES) && !defined(PG_HEADER_TABLE) && !defined(PG_TRACE)
+    // other page formats and traced builds leave pgFastHeap NULL, which keeps pgalloc_inline() out of them
+    pgFastHeap = (PgFastHeap *)heap;
+#endif
+    return heap;
+}
+
+static Heap *takeHeap(void)
+{
+    collectPool();
+
+    Heap *heap = freeHeaps;
+
+    if (heap) {
+        freeHeaps = heap->nextHeap;
+    } else {
+        heap = newHeap();
+    }
+
+    if (heap) {
+        heap->nextHeap = NULL;
+    }
+
+    return heap;
+}
+
+static Heap *newHeap(void)
+{
+    /*
+     * Heaps are never returned, threads that exit leave theirs on freeHeaps and destroyed caches on cacheHeaps.
+     * They are mapped directly rather than taken from malloc(), which may be this library.
+     */
+    if (heapSlabLeft < sizeof(Heap)) {
+        heapSlab = mapPages(HEAP_SLAB, OS_PAGE_SIZE);
+        if (!heapSlab) {
+            heapSlabLeft = 0;
+            return NULL;
+        }
+        heapSlabLeft = HEAP_SLAB;
+    }
+
+    Heap *heap = (Heap *)heapSlab;
+
+    heapSlab += sizeof(Heap);
+    heapSlabLeft -= sizeof(Heap);
+
+    heap->nextAll = allHeaps;
+    allHeaps = heap;
+
+    return heap;
+}
+
+static void releaseHeap(void *arg)
+{
+    Heap *heap = (Heap *)arg;
+
+    // pages are handed over with every remote free reclaimed so far, see collectPool() for later ones
+    collectRemote(heap);
+
+    pthread_mutex_lock(&poolLock);
+
+    releaseEmptyPages(heap);
+
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        // the pool never allocates, so parked pages join the others there
+        while (unparkPage(heap, i)) {
+        }
+
+        while (heap->pages[i]) {
+            void *page = heap->pages[i];
+            PageHeader *ph = (PageHeader *)page;
+
+            unlinkPage(&(heap->pages[i]), page);
+
+            if (ph->blocksUsed == 0) {
+                dropPage(heap, page);
+            } else {
+                atomic_store_explicit(&(ph->owner), &pool, memory_order_relaxed);
+                pushPage(&(pool.pages[i]), page);
+                countSub(&(heap->stats[i].pages), 1);
+                countAdd(&(pool.stats[i].pages), 1);
+            }
+        }
+    }
+
+    while (heap->fullPages) {
+        void *page = removeFullList(heap, heap->fullPages);
+        unsigned int i = getPageIndex(((PageHeader *)page)->blockSize);
+
+        atomic_store_explicit(&(((PageHeader *)page)->owner), &pool, memory_order_relaxed);
+        addFullList(&pool, page);
+        countSub(&(heap->stats[i].pages), 1);
+        countAdd(&(pool.stats[i].pages), 1);
+    }
+
+    heap->nextHeap = freeHeaps;
+    freeHeaps = heap;
+
+    pthread_mutex_unlock(&poolLock);
+
+    if (localHeap == heap) {
+        localHeap = NULL;
+        pgFastHeap = NULL;
+    }
+}
+
+static void initPage(void *page, Heap *heap, unsigned int index, unsigned short flags)
+{
+    PageHeader *header = (PageHeader *)page;
+
+    header->blockSize = classSize[index];
+    header->blocksUsed = 0;
+    header->flags = flags;
+    header->freeList = NULL;
+    header->avl = (void *)(spanStart(page) + (classPages[index] * PAGE_SIZE));
+    header->nextPage = NULL;
+    header->prevPage = NULL;
+    atomic_store_explicit(&(header->owner), heap, memory_order_relaxed);
+    atomic_store_explicit(&(header->remoteFree), NULL, memory_order_relaxed);
+    header->remoteNext = NULL;
+
+#ifdef PG_BITMAP_PAGES
+    unsigned int blocks = classBlocks[index];
+
+    for (unsigned int w = 0; w < BITMAP_WORDS; w++) {
+        if (blocks >= 64 * (w + 1)) {
+            header->bitmap[w] = 0;
+        } else if (blocks > 64 * w) {
+            header->bitmap[w] = ~((UINT64_C(1) << (blocks - (64 * w))) - 1);
+        } else {
+            header->bitmap[w] = ~UINT64_C(0);
+        }
+    }
+#endif
+}
+
+static void *newPage(Heap *heap, unsigned int index)
+{
+    void *page = NULL;
+
+    if (atomic_load_explicit(&(pool.remotePages), memory_order_relaxed)) {
+        // pool pages may be about to go back to their chunks
+        pthread_mutex_lock(&poolLock);
+        collectPool();
+        pthread_mutex_unlock(&poolLock);
+    }
+
+    int zeroed = 0;
+
+    if (heap->file) {
+        page = fileSpan(heap->file, classPages[index], &zeroed);
+    } else {
+        page = allocSpan(classPages[index], &zeroed);
+    }
+    if (!page) {
+        return NULL;
+    }
+    page = spanHeader(page);
+
+    initPage(page, heap, index, zeroed ? PAGE_ZEROED : 0);
+
+    countAdd(&(heap->stats[index].newPages), 1);
+    countAdd(&(heap->stats[index].pages), 1);
+
+    return page;
+}
+
+static void dropPage(Heap *heap, void *page)
+{
+    if (heap->cache) {
+        destroyObjects(heap->cache, page);
+    }
+
+    countSub(&(heap->stats[getPageIndex(((PageHeader *)page)->blockSize)].pages), 1);
+    if (heap->file) {
+        fileRelease(page);
+    } else {
+        freeSpan(page);
+    }
+}
+
+static void countAdd(_Atomic(uint64_t) *counter, uint64_t num)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + num, memory_order_relaxed);
+}
+
+static void countSub(_Atomic(uint64_t) *counter, uint64_t num)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - num, memory_order_relaxed);
+}
+
+static ChunkHeader *newChunk(unsigned int node)
+{
+    /*
+     * Aligned on CHUNK_SIZE to make chunkMask work in getPage()
+     * Freshly mapped memory is already zero filled, so nothing needs to be cleared.
+     */
+    ChunkHeader *chunk = mapPages(CHUNK_SIZE, CHUNK_SIZE);
+
+    if (!chunk) {
+        return NULL;
+    }
+
+    if (!markRegion(chunk, REGION_CHUNK)) {
+        munmap(chunk, CHUNK_SIZE);
+        return NULL;
+    }
+
+#ifdef SYS_mbind
+    if (numaNodes > 1 || node > 0) {
+        // before the header is written, which touches the first page; failing leaves the kernel's default placement
+        unsigned long mask = 1UL << node;
+
+        syscall(SYS_mbind, chunk, CHUNK_SIZE, MPOL_PREFERRED, &mask, sizeof(mask) * CHAR_BIT + 1, 0);
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    // a chunk is exactly one huge page, back it with one where the kernel allows
+    madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+
+    chunk->kind = SMALL_CHUNK;
+    chunk->node = node;
+    chunk->pagesFree = CHUNK_PAGES - CHUNK_META_PAGES;
+    nodePools[node].chunkCount++;
+    nodePools[node].pagesFree += chunk->pagesFree;
+
+    for (unsigned int i = CHUNK_META_PAGES; i < CHUNK_PAGES; i++) {
+        chunk->freeMap[i / 64] |= ((uint64_t)1) << (i % 64);
+    }
+
+    return chunk;
+}
+
+static int findRun(ChunkHeader *chunk, unsigned int num)
+{
+    unsigned int run = 0;
+
+    for (unsigned int i = 0; i < CHUNK_PAGES; i++) {
+        uint64_t word = chunk->freeMap[i / 64];
+
+        if ((i % 64) == 0 && word == 0) {
+            // no free pages in this word
+            run = 0;
+            i += 63;
+            continue;
+        }
+
+        if (word & (((uint64_t)1) << (i % 64))) {
+            if (++run == num) {
+                return (int)(i + 1 - num);
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+    return -1;
+}
+
+static void *allocSpan(unsigned int num, int *zeroed)
+{
+    ChunkHeader *chunk = NULL;
+    int first = -1;
+    unsigned int node = currentNode();
+
+    pthread_mutex_lock(&chunkLock);
+
+    for (chunk = nodePools[node].chunks; chunk; chunk = chunk->nextChunk) {
+        if (chunk->pagesFree >= num && (first = findRun(chunk, num)) >= 0) {
+            break;
+        }
+    }
+
+    if (!chunk) {
+        chunk = newChunk(node);
+        if (!chunk) {
+            pthread_mutex_unlock(&chunkLock);
+            return NULL;
+        }
+
+        pushChunk(chunk);
+        first = findRun(chunk, num);
+    }
+
+    void *page = (void *)((uintptr_t)chunk + ((uintptr_t)first * PAGE_SIZE));
+    PageHeader *header = spanHeader(page);
+
+    // pages that are free but not dirty were either never touched or purged by purgeChunk()
+    *zeroed = 1;
+
+    for (unsigned int i = (unsigned int)first; i < (unsigned int)first + num; i++) {
+        uint64_t bit = ((uint64_t)1) << (i % 64);
+
+        if (chunk->dirtyMap[i / 64] & bit) {
+            *zeroed = 0;
+            chunk->dirtyMap[i / 64] &= ~bit;
+            chunk->pagesDirty--;
+            dirtyPages--;
+        }
+
+        chunk->freeMap[i / 64] &= ~bit;
+        chunk->spans[i] = header;
+    }
+
+    chunk->pagesFree -= num;
+    nodePools[chunk->node].pagesFree -= num;
+    if (chunk->pagesFree == 0) {
+        unlinkChunk(chunk);
+    }
+
+    pthread_mutex_unlock(&chunkLock);
+
+    return page;
+}
+
+static void freeSpan(void *page)
+{
+    unsigned int num = classPages[getPageIndex(((PageHeader *)page)->blockSize)];
+
+    pthread_mutex_lock(&chunkLock);
+    releasePages((void *)spanStart(page), num);
+    pthread_mutex_unlock(&chunkLock);
+}
+
+static void releasePages(void *page, unsigned int num)
+{
+    ChunkHeader *chunk = (ChunkHeader *) ((((uintptr_t) page) & chunkMask));
+    unsigned int first = (((uintptr_t) page) - ((uintptr_t) chunk)) >> PAGE_SHIFT;
+
+    if (chunk->pagesFree == 0) {
+        pushChunk(chunk);
+    }
+
+    for (unsigned int i = first; i < first + num; i++) {
+        chunk->freeMap[i / 64] |= ((uint64_t)1) << (i % 64);
+        chunk->dirtyMap[i / 64] |= ((uint64_t)1) << (i % 64);
+        chunk->spans[i] = NULL;
+    }
+
+    uint64_t now = nowMs();
+
+    if (chunk->pagesDirty == 0) {
+        chunk->dirtySince = now;
+    }
+    if (oldestDirty == 0) {
+        oldestDirty = now;
+    }
+
+    chunk->pagesFree += num;
+    nodePools[chunk->node].pagesFree += num;
+    chunk->pagesDirty += num;
+    dirtyPages += num;
+
+    if (dirtyPages > maxDirtyPages || (now - oldestDirty) >= decayMs) {
+        decayChunks(0);
+    }
+}
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    // never 0, which marks no dirty pages
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000) + 1;
+}
+
+static size_t purgeChunk(ChunkHeader *chunk)
+{
+    size_t bytes = 0;
+    unsigned int i = 0;
+
+    while (i < CHUNK_PAGES) {
+        if (!(chunk->dirtyMap[i / 64] & (((uint64_t)1) << (i % 64)))) {
+            i++;
+            continue;
+        }
+
+        // return the whole run of dirty pages at once
+        unsigned int first = i;
+
+        while (i < CHUNK_PAGES && (chunk->dirtyMap[i / 64] & (((uint64_t)1) << (i % 64)))) {
+            chunk->dirtyMap[i / 64] &= ~(((uint64_t)1) << (i % 64));
+            i++;
+        }
+
+        madvise((void *)((uintptr_t)chunk + ((uintptr_t)first * PAGE_SIZE)), (size_t)(i - first) * PAGE_SIZE, MADV_DONTNEED);
+        bytes += (size_t)(i - first) * PAGE_SIZE;
+    }
+
+    dirtyPages -= chunk->pagesDirty;
+    chunk->pagesDirty = 0;
+    chunk->dirtySince = 0;
+
+    return bytes;
+}
+
+static size_t decayChunks(int force)
+{
+    uint64_t now = nowMs();
+    int purgeAll = force || dirtyPages > maxDirtyPages;
+    unsigned int freeChunks = 0;
+    size_t bytes = 0;
+
+    oldestDirty = 0;
+
+    for (unsigned int node = 0; node < NUMA_NODES; node++) {
+        ChunkHeader *chunk = nodePools[node].chunks;
+
+        while (chunk) {
+            ChunkHeader *next = chunk->nextChunk;
+
+            if (chunk->pagesDirty && (purgeAll || (now - chunk->dirtySince) >= decayMs)) {
+                bytes += purgeChunk(chunk);
+            }
+
+            if (chunk->pagesFree == CHUNK_PAGES - CHUNK_META_PAGES && chunk->pagesDirty == 0) {
+                // an entirely free chunk, keep a few around for the next burst
+                if (force || ++freeChunks > RETAIN_CHUNKS) {
+                    unlinkChunk(chunk);
+                    nodePools[node].chunkCount--;
+                    nodePools[node].pagesFree -= chunk->pagesFree;
+                    markRegion(chunk, REGION_NONE);
+                    munmap(chunk, CHUNK_SIZE);
+                    bytes += CHUNK_META_PAGES * PAGE_SIZE;
+                }
+            } else if (chunk->pagesDirty && (oldestDirty == 0 || chunk->dirtySince < oldestDirty)) {
+                oldestDirty = chunk->dirtySince;
+            }
+
+            chunk = next;
+        }
+    }
+
+    return bytes;
+}
+
+static void pushChunk(ChunkHeader *chunk)
+{
+    void **chunks = &(nodePools[chunk->node].chunks);
+    ChunkHeader *headChunk = (ChunkHeader *)*chunks;
+
+    chunk->prevChunk = NULL;
+    chunk->nextChunk = headChunk;
+
+    if (headChunk) {
+        headChunk->prevChunk = chunk;
+    }
+
+    *chunks = chunk;
+}
+
+static void unlinkChunk(ChunkHeader *chunk)
+{
+    ChunkHeader *nch = (ChunkHeader *)chunk->nextChunk;
+    ChunkHeader *pch = (ChunkHeader *)chunk->prevChunk;
+
+    if (pch != NULL) {
+        pch->nextChunk = chunk->nextChunk;
+    } else {
+        nodePools[chunk->node].chunks = chunk->nextChunk;
+    }
+
+    if (nch != NULL) {
+        nch->prevChunk = chunk->prevChunk;
+    }
+
+    chunk->prevChunk = NULL;
+    chunk->nextChunk = NULL;
+}
+
+static unsigned int currentNode(void)
+{
+    if (localNode >= 0) {
+        return (unsigned int)localNode;
+    }
+
+    pthread_once(&numaOnce, findNodes);
+
+    unsigned int node = 0;
+
+#ifdef SYS_getcpu
+    if (numaNodes > 1 && syscall(SYS_getcpu, NULL, &node, NULL) != 0) {
+        node = 0;
+    }
+#endif
+
+    return node < NUMA_NODES ? node : NUMA_NODES - 1;
+}
+
+static void findNodes(void)
+{
+    // read with plain system calls, stdio may allocate
+    char buf[64] = { 0 };
+    int fd = open(NODE_POSSIBLE, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    // a list of ranges such as "0-3", the last number is the highest node
+    unsigned int last = 0;
+
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            last = (last * 10) + (unsigned int)(buf[i] - '0');
+        } else if (buf[i] == '-' || buf[i] == ',') {
+            last = 0;
+        }
+    }
+
+    numaNodes = last + 1;
+}
+
+int pgnode(int node)
+{
+    if (node >= NUMA_NODES || node < -1) {
+        return 0;
+    }
+
+    localNode = node;
+    return 1;
+}
+
+static unsigned int blocksLeft(void *page)
+{
+    return blocksPerPage(page) - ((PageHeader *)page)->blocksUsed;
+}
+
+static unsigned int blocksPerPage(void *page)
+{
+    unsigned int blockSize = ((PageHeader *)page)->blockSize;
+
+    return classBlocks[getPageIndex(blockSize)];
+}
+
+static uintptr_t spanEnd(void *page)
+{
+    unsigned int blockSize = ((PageHeader *)page)->blockSize;
+
+    return spanStart(page) + (classPages[getPageIndex(blockSize)] * PAGE_SIZE);
+}
+
+static uintptr_t spanStart(void *page)
+{
+#ifdef PG_HEADER_TABLE
+    ChunkHeader *chunk = (ChunkHeader *) ((((uintptr_t) page) & chunkMask));
+
+    return (uintptr_t)chunk + ((uintptr_t)((PageHeader *)page - chunk->headers) * PAGE_SIZE);
+#else
+    return (uintptr_t)page;
+#endif
+}
+
+static PageHeader *spanHeader(void *span)
+{
+#ifdef PG_HEADER_TABLE
+    ChunkHeader *chunk = (ChunkHeader *) ((((uintptr_t) span) & chunkMask));
+
+    return &(chunk->headers[(((uintptr_t) span) - ((uintptr_t) chunk)) >> PAGE_SHIFT]);
+#else
+    return (PageHeader *)span;
+#endif
+}
+
+#ifdef PG_BITMAP_PAGES
+static void clearBlock(void *page, void *ptr)
+{
+    PageHeader *ph = (PageHeader *)page;
+    size_t i = ((spanEnd(page) - (uintptr_t)ptr) / ph->blockSize) - 1;
+    uint64_t bit = UINT64_C(1) << (i % 64);
+
+    if (!(ph->bitmap[i / 64] & bit)) {
+        static const char msg[] = "pgfree(): double free detected\n";
+
+        // stdio may allocate, and this may well be malloc() itself
+        (void)!write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
+
+    ph->bitmap[i / 64] &= ~bit;
+}
+#endif
+
+void *pgalloc(size_t bytes)
+{
+    void *ptr = NULL;
+
+    if (countSample(bytes) && (ptr = sampleAlloc(bytes, LARGE_OFFSET, NULL))) {
+        traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+        return ptr;
+    }
+
+    if (bytes > maxPageData) {
+        ptr = largeAlloc(bytes, LARGE_OFFSET, NULL);
+        traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+        return ptr;
+    }
+
+    unsigned int index = getPageIndex(bytes);
+
+    Heap *heap = getHeap();
+
+    if (!heap) {
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&(heap->remotePages), memory_order_relaxed)) {
+        collectRemote(heap);
+    }
+
+    ptr = allocBlock(heap, index, bytes, NULL);
+    traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+
+    return ptr;
+}
+
+void *pgcalloc(size_t num, size_t size)
+{
+    int zeroed = 0;
+    void *ptr = NULL;
+
+    if (size && num > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    size_t bytes = num * size;
+
+    if (countSample(bytes)) {
+        ptr = sampleAlloc(bytes, LARGE_OFFSET, &zeroed);
+    }
+
+    if (!ptr && bytes > maxPageData) {
+        ptr = largeAlloc(bytes, LARGE_OFFSET, &zeroed);
+    } else if (!ptr) {
+        unsigned int index = getPageIndex(bytes);
+
+        Heap *heap = getHeap();
+
+        if (!heap) {
+            return NULL;
+        }
+
+        if (atomic_load_explicit(&(heap->remotePages), memory_order_relaxed)) {
+            collectRemote(heap);
+        }
+
+        ptr = allocBlock(heap, index, bytes, &zeroed);
+    }
+
+    if (ptr && !zeroed) {
+        memset(ptr, 0, bytes);
+    }
+
+    traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+
+    return ptr;
+}
+
+void *pgrealloc(void *ptr, size_t bytes)
+{
+    if (ptr == NULL) {
+        return pgalloc(bytes);
+    }
+
+    if (bytes == 0) {
+        pgfree(ptr);
+        return NULL;
+    }
+
+    void *page = getPage(ptr);
+    size_t usable = pgusable_size(ptr);
+
+    /*
+     * Grow or shrink in place while the block still holds the request, unless a large span
+     * would be left holding a request that now fits in a page. A sampled block always moves,
+     * so its Sample never goes stale.
+     */
+    if (bytes <= usable && (!isLargePage(page) || (bytes > maxPageData && !((LargeHeader *)page)->sampled))) {
+        // a replay gets to move the block, a moved block is traced by pgalloc() and pgfree()
+        traceEvent(PG_TRACE_FREE, ptr, 0);
+        traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+        return ptr;
+    }
+
+    void *mem = pgalloc(bytes);
+    if (!mem) {
+        return NULL;
+    }
+
+    memcpy(mem, ptr, bytes < usable ? bytes : usable);
+    pgfree(ptr);
+
+    return mem;
+}
+
+void *pgalloc_aligned(size_t alignment, size_t bytes)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) || alignment > LARGE_ALIGN_MAX) {
+        return NULL;
+    }
+
+    if (countSample(bytes)) {
+        void *ptr = sampleAlloc(bytes, alignment, NULL);
+
+        if (ptr) {
+            traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+            return ptr;
+        }
+    }
+
+    if (bytes <= maxPageData && alignment <= PAGE_SIZE) {
+        /*
+         * Blocks are carved down from the page aligned end of their span, so every block of a class
+         * is aligned on any power of 2 that divides the class size.
+         */
+        unsigned int index = getPageIndex(bytes);
+
+        while (index < SIZE_CLASSES && (classSize[index] & (alignment - 1))) {
+            index++;
+        }
+
+        if (index < SIZE_CLASSES) {
+            Heap *heap = getHeap();
+
+            if (!heap) {
+                return NULL;
+            }
+
+            if (atomic_load_explicit(&(heap->remotePages), memory_order_relaxed)) {
+                collectRemote(heap);
+            }
+
+            void *ptr = allocBlock(heap, index, bytes, NULL);
+            traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+
+            return ptr;
+        }
+    }
+
+    void *ptr = largeAlloc(bytes, alignment, NULL);
+    traceEvent(PG_TRACE_ALLOC, ptr, bytes);
+
+    return ptr;
+}
+
+size_t pgalloc_bulk(size_t bytes, size_t num, void **out)
+{
+    size_t got = 0;
+
+    // the whole call counts towards the next sample, but only its first block may be sampled
+    if (num && countSample(bytes && num > SIZE_MAX / bytes ? SIZE_MAX : bytes * num)
+            && (out[0] = sampleAlloc(bytes, LARGE_OFFSET, NULL))) {
+        traceEvent(PG_TRACE_ALLOC, out[0], bytes);
+        got = 1;
+    }
+
+    size_t sampled = got;
+
+    if (bytes > maxPageData) {
+        while (got < num && (out[got] = largeAlloc(bytes, LARGE_OFFSET, NULL))) {
+            traceEvent(PG_TRACE_ALLOC, out[got], bytes);
+            got++;
+        }
+
+        return got;
+    }
+
+    unsigned int index = getPageIndex(bytes);
+
+    Heap *heap = getHeap();
+
+    if (!heap) {
+        return got;
+    }
+
+    if (atomic_load_explicit(&(heap->remotePages), memory_order_relaxed)) {
+        collectRemote(heap);
+    }
+
+    while (got < num) {
+        void *page = availPage(heap, index);
+
+        if (!page) {
+            break;
+        }
+
+        got += takeBlocks(page, out + got, num - got);
+
+        if (blocksLeft(page) == 0) {
+            unlinkPage(&(heap->pages[index]), page);
+            addFullList(heap, page);
+        }
+    }
+
+    countAdd(&(heap->stats[index].allocs), got - sampled);
+    countAdd(&(heap->stats[index].requested), (got - sampled) * bytes);
+
+    for (size_t i = sampled; i < got; i++) {
+        traceEvent(PG_TRACE_ALLOC, out[i], bytes);
+    }
+
+    return got;
+}
+
+PgArena *pgarena_create(void)
+{
+    int zeroed = 0;
+    PgArena *arena = allocSpan(ARENA_PAGES, &zeroed);
+
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->bump = (char *)arena + ARENA_HEADER;
+    arena->end = (char *)arena + (ARENA_PAGES * PAGE_SIZE);
+    arena->spans = NULL;
+    arena->large = NULL;
+
+    pthread_mutex_lock(&chunkLock);
+    arena->prevArena = NULL;
+    arena->nextArena = arenas;
+    if (arenas) {
+        arenas->prevArena = arena;
+    }
+    arenas = arena;
+    pthread_mutex_unlock(&chunkLock);
+
+    return arena;
+}
+
+void *pgarena_alloc(PgArena *arena, size_t bytes)
+{
+    if (bytes > ARENA_DIRECT) {
+        return arenaDirect(arena, bytes);
+    }
+
+    // keeps every block aligned like a pgalloc() block
+    size_t size = bytes ? (bytes + SIZE_CLASS_ALIGN - 1) & ~((size_t)SIZE_CLASS_ALIGN - 1) : SIZE_CLASS_ALIGN;
+
+    if (size > (size_t)(arena->end - arena->bump)) {
+        // the rest of the current span is given up
+        ArenaSpan *span = newArenaSpan(arena, ARENA_PAGES);
+
+        if (!span) {
+            return NULL;
+        }
+
+        arena->bump = (char *)span + ARENA_HEADER;
+        arena->end = (char *)span + (ARENA_PAGES * PAGE_SIZE);
+    }
+
+    void *ptr = arena->bump;
+    arena->bump += size;
+
+    return ptr;
+}
+
+void pgarena_reset(PgArena *arena)
+{
+    releaseArena(arena);
+
+    arena->bump = (char *)arena + ARENA_HEADER;
+    arena->end = (char *)arena + (ARENA_PAGES * PAGE_SIZE);
+}
+
+void pgarena_destroy(PgArena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    releaseArena(arena);
+
+    pthread_mutex_lock(&chunkLock);
+    if (arena->prevArena) {
+        arena->prevArena->nextArena = arena->nextArena;
+    } else {
+        arenas = arena->nextArena;
+    }
+    if (arena->nextArena) {
+        arena->nextArena->prevArena = arena->prevArena;
+    }
+    releasePages(arena, ARENA_PAGES);
+    pthread_mutex_unlock(&chunkLock);
+}
+
+static ArenaSpan *newArenaSpan(PgArena *arena, unsigned int pages)
+{
+    int zeroed = 0;
+    ArenaSpan *span = allocSpan(pages, &zeroed);
+
+    if (!span) {
+        return NULL;
+    }
+
+    span->pages = pages;
+
+    pthread_mutex_lock(&chunkLock);
+    span->nextSpan = arena->spans;
+    arena->spans = span;
+    pthread_mutex_unlock(&chunkLock);
+
+    return span;
+}
+
+static void *arenaDirect(PgArena *arena, size_t bytes)
+{
+    if (bytes <= ((size_t)ARENA_SPAN_MAX * PAGE_SIZE) - ARENA_HEADER) {
+        // the current span keeps serving small requests
+        ArenaSpan *span = newArenaSpan(arena, (unsigned int)((bytes + ARENA_HEADER + PAGE_SIZE - 1) / PAGE_SIZE));
+
+        return span ? (char *)span + ARENA_HEADER : NULL;
+    }
+
+    if (bytes > SIZE_MAX - SIZE_CLASS_ALIGN) {
+        return NULL;
+    }
+
+    void **block = largeAlloc(bytes + SIZE_CLASS_ALIGN, LARGE_OFFSET, NULL);
+
+    if (!block) {
+        return NULL;
+    }
+
+    *block = arena->large;
+    arena->large = block;
+
+    return (char *)block + SIZE_CLASS_ALIGN;
+}
+
+static void releaseArena(PgArena *arena)
+{
+    void *block = arena->large;
+
+    while (block) {
+        void *next = *((void **)block);
+
+        largeFree(getPage(block));
+        block = next;
+    }
+    arena->large = NULL;
+
+    if (!arena->spans) {
+        return;
+    }
+
+    // every span goes back under a single lock, no block is ever looked at
+    pthread_mutex_lock(&chunkLock);
+    ArenaSpan *span = arena->spans;
+
+    while (span) {
+        ArenaSpan *next = span->nextSpan;
+
+        releasePages(span, span->pages);
+        span = next;
+    }
+    arena->spans = NULL;
+    pthread_mutex_unlock(&chunkLock);
+}
+
+PgCache *pgcache_create(size_t objSize, size_t align, void (*ctor)(void *), void (*dtor)(void *))
+{
+    if (align == 0) {
+        align = SIZE_CLASS_ALIGN;
+    }
+
+    if ((align & (align - 1)) || align > PAGE_SIZE) {
+        return NULL;
+    }
+
+    // blocks of constructed objects start with room for the free list link
+    size_t offset = (ctor || dtor) ? (align > SIZE_CLASS_ALIGN ? align : SIZE_CLASS_ALIGN) : 0;
+
+    if (objSize > SIZE_CLASS_MAX - offset) {
+        return NULL;
+    }
+
+    unsigned int index = getPageIndex((unsigned int)(offset + (objSize ? objSize : 1)));
+
+    while (index < SIZE_CLASSES && (classSize[index] & (align - 1))) {
+        index++;
+    }
+
+    if (index == SIZE_CLASSES) {
+        return NULL;
+    }
+
+    PgCache *cache = pgalloc(sizeof(PgCache));
+
+    if (!cache) {
+        return NULL;
+    }
+
+    /*
+     * Never a heap left by a thread, which may still get blocks queued by other threads after its pages went to the pool
+     * and may own full pages off the list with PG_NO_FULL_LIST.
+     */
+    pthread_mutex_lock(&poolLock);
+    Heap *heap = cacheHeaps;
+    if (heap) {
+        cacheHeaps = heap->nextHeap;
+        heap->nextHeap = NULL;
+    } else {
+        heap = newHeap();
+    }
+    if (heap) {
+        heap->cache = cache;
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (!heap) {
+        pgfree(cache);
+        return NULL;
+    }
+
+    cache->heap = heap;
+    cache->index = index;
+    cache->offset = (unsigned int)offset;
+    cache->objSize = objSize;
+    cache->keepPages = EMPTY_CACHE;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    pthread_mutex_init(&(cache->lock), NULL);
+
+    pthread_mutex_lock(&cacheLock);
+    cache->prevCache = NULL;
+    cache->nextCache = caches;
+    if (caches) {
+        caches->prevCache = cache;
+    }
+    caches = cache;
+    pthread_mutex_unlock(&cacheLock);
+
+    return cache;
+}
+
+void *pgcache_alloc(PgCache *cache)
+{
+    Heap *heap = cache->heap;
+    void *block = NULL;
+
+    pthread_mutex_lock(&(cache->lock));
+
+    // pgfree() hands objects to pgcache_free(), so no other thread ever queues blocks on a cache
+    assert(atomic_load_explicit(&(heap->remotePages), memory_order_relaxed) == NULL);
+
+    void *page = availPage(heap, cache->index);
+
+    if (!page) {
+        pthread_mutex_unlock(&(cache->lock));
+        return NULL;
+    }
+
+    // freed blocks hold constructed objects, blocks below avl were never handed out
+    int fresh = 0;
+
+    block = popBlock(page, &fresh);
+    ((PageHeader *)page)->blocksUsed++;
+
+    if (blocksLeft(page) == 0) {
+        unlinkPage(&(heap->pages[cache->index]), page);
+        addFullList(heap, page);
+    }
+
+    countAdd(&(heap->stats[cache->index].allocs), 1);
+    countAdd(&(heap->stats[cache->index].requested), cache->objSize);
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    void *obj = (char *)block + cache->offset;
+
+    if (fresh && cache->ctor) {
+        cache->ctor(obj);
+    }
+
+    return obj;
+}
+
+void pgcache_free(PgCache *cache, void *obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    void *block = (char *)obj - cache->offset;
+
+    pthread_mutex_lock(&(cache->lock));
+    recycleBlock(cache->heap, getPage(block), block);
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+int pgcache_reserve(PgCache *cache, size_t objects)
+{
+    Heap *heap = cache->heap;
+    unsigned int i = cache->index;
+    size_t available = 0;
+    int ok = 1;
+
+    pthread_mutex_lock(&(cache->lock));
+
+    assert(atomic_load_explicit(&(heap->remotePages), memory_order_relaxed) == NULL);
+
+    size_t pages = (objects + classBlocks[i] - 1) / classBlocks[i];
+
+    if (pages > cache->keepPages) {
+        cache->keepPages = pages > UINT_MAX ? UINT_MAX : (unsigned int)pages;
+    }
+
+    for (void *page = heap->pages[i]; page; page = ((PageHeader *)page)->nextPage) {
+        available += blocksLeft(page);
+    }
+    for (unsigned int b = 0; b < PARTIAL_BUCKETS; b++) {
+        for (void *page = heap->partialPages[i][b]; page; page = ((PageHeader *)page)->nextPage) {
+            available += blocksLeft(page);
+        }
+    }
+    available += (size_t)heap->emptyCount[i] * classBlocks[i];
+
+    while (available < objects) {
+        void *page = newPage(heap, i);
+
+        if (!page) {
+            ok = 0;
+            break;
+        }
+
+        pushPage(&(heap->emptyPages[i]), page);
+        heap->emptyCount[i]++;
+        available += classBlocks[i];
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return ok;
+}
+
+void pgcache_destroy(PgCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    if (cache->prevCache) {
+        cache->prevCache->nextCache = cache->nextCache;
+    } else {
+        caches = cache->nextCache;
+    }
+    if (cache->nextCache) {
+        cache->nextCache->prevCache = cache->prevCache;
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    Heap *heap = cache->heap;
+
+    // every object has been freed, so every page is empty
+    releaseEmptyPages(heap);
+    assert(heap->pages[cache->index] == NULL && heap->fullPages == NULL);
+    assert(atomic_load_explicit(&(heap->remotePages), memory_order_relaxed) == NULL);
+
+    pthread_mutex_lock(&poolLock);
+    heap->cache = NULL;
+    heap->nextHeap = cacheHeaps;
+    cacheHeaps = heap;
+    pthread_mutex_unlock(&poolLock);
+
+    pthread_mutex_destroy(&(cache->lock));
+    pgfree(cache);
+}
+
+static void destroyObjects(PgCache *cache, void *page)
+{
+    if (!cache->dtor) {
+        return;
+    }
+
+    PageHeader *ph = (PageHeader *)page;
+    uintptr_t end = spanEnd(page);
+
+    // blocks are carved down from the end of the span, so every block from avl up has been constructed
+    for (uintptr_t block = (uintptr_t)ph->avl; block < end; block += ph->blockSize) {
+        cache->dtor((char *)block + cache->offset);
+    }
+}
+
+PgFile *pgfile_open(const char *path, void *base, size_t size)
+{
+    if (((uintptr_t)base % CHUNK_SIZE) || size == 0 || (size % CHUNK_SIZE) || size / CHUNK_SIZE > UINT_MAX) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // one process at a time, and one handle per file within a process since each open() takes a lock of its own
+    struct stat st;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    int created = (st.st_size == 0);
+
+    if ((created && ftruncate(fd, (off_t)size) != 0) || (!created && (uintmax_t)st.st_size != size)) {
+        close(fd);
+        return NULL;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+    // never replaces a mapping, which may well belong to someone else
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void *mem = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+    if (mem == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    PgFile *file = pgalloc(sizeof(PgFile));
+
+    if (mem != base || !file) {
+        // without MAP_FIXED_NOREPLACE the address is only a hint
+        pgfree(file);
+        munmap(mem, size);
+        close(fd);
+        return NULL;
+    }
+
+    file->header = (FileHeader *)((uintptr_t)base + (CHUNK_META_PAGES * PAGE_SIZE));
+    file->base = base;
+    file->size = size;
+    file->fd = fd;
+
+    if (created) {
+        formatFile(base, (unsigned int)(size / CHUNK_SIZE));
+    }
+
+    if (!fileMatches(file->header, (uintptr_t)base, size) || !markFile(file, REGION_CHUNK)) {
+        markFile(file, REGION_NONE);
+        pgfree(file);
+        munmap(mem, size);
+        close(fd);
+        return NULL;
+    }
+
+    // the handle of the process that synced the file is long gone
+    Heap *heap = &(file->header->heap);
+
+    heap->file = file;
+    pthread_mutex_init(&(file->lock), NULL);
+
+    pthread_mutex_lock(&fileLock);
+    file->prevFile = NULL;
+    file->nextFile = files;
+    if (files) {
+        files->prevFile = file;
+    }
+    files = file;
+    pthread_mutex_unlock(&fileLock);
+
+    return file;
+}
+
+void *pgfile_alloc(PgFile *file, size_t bytes)
+{
+    if (bytes > maxPageData) {
+        return NULL;
+    }
+
+    Heap *heap = &(file->header->heap);
+
+    pthread_mutex_lock(&(file->lock));
+    touchFile(file);
+
+    // pgfree() hands blocks of a file heap to pgfile_free(), so no other thread ever queues blocks on it
+    assert(atomic_load_explicit(&(heap->remotePages), memory_order_relaxed) == NULL);
+
+    void *ptr = allocBlock(heap, getPageIndex((unsigned int)bytes), bytes, NULL);
+
+    pthread_mutex_unlock(&(file->lock));
+
+    return ptr;
+}
+
+void pgfile_free(PgFile *file, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    Heap *heap = &(file->header->heap);
+    void *page = getPage(ptr);
+
+    assert(atomic_load_explicit(&(((PageHeader *)page)->owner), memory_order_relaxed) == heap);
+
+    pthread_mutex_lock(&(file->lock));
+    touchFile(file);
+    assert(atomic_load_explicit(&(heap->remotePages), memory_order_relaxed) == NULL);
+
+    recycleBlock(heap, page, ptr);
+    pthread_mutex_unlock(&(file->lock));
+}
+
+void *pgfile_root(PgFile *file)
+{
+    pthread_mutex_lock(&(file->lock));
+    void *root = file->header->root;
+    pthread_mutex_unlock(&(file->lock));
+
+    return root;
+}
+
+void pgfile_set_root(PgFile *file, void *root)
+{
+    pthread_mutex_lock(&(file->lock));
+    touchFile(file);
+    file->header->root = root;
+    pthread_mutex_unlock(&(file->lock));
+}
+
+int pgfile_sync(PgFile *file)
+{
+    FileHeader *header = file->header;
+    int ok = 1;
+
+    pthread_mutex_lock(&(file->lock));
+    assert(atomic_load_explicit(&(header->heap.remotePages), memory_order_relaxed) == NULL);
+
+    if (!header->clean) {
+        // every block and page header reaches the file before it is declared consistent
+        ok = msync(file->base, file->size, MS_SYNC) == 0;
+        if (ok) {
+            header->clean = 1;
+            ok = msync(file->base, (CHUNK_META_PAGES + FILE_META_PAGES) * PAGE_SIZE, MS_SYNC) == 0;
+        }
+    }
+
+    pthread_mutex_unlock(&(file->lock));
+
+    return ok;
+}
+
+void pgfile_close(PgFile *file)
+{
+    if (!file) {
+        return;
+    }
+
+    pgfile_sync(file);
+
+    pthread_mutex_lock(&fileLock);
+    if (file->prevFile) {
+        file->prevFile->nextFile = file->nextFile;
+    } else {
+        files = file->nextFile;
+    }
+    if (file->nextFile) {
+        file->nextFile->prevFile = file->prevFile;
+    }
+    pthread_mutex_unlock(&fileLock);
+
+    markFile(file, REGION_NONE);
+    munmap(file->base, file->size);
+    close(file->fd);
+
+    pthread_mutex_destroy(&(file->lock));
+    pgfree(file);
+}
+
+static void *fileSpan(PgFile *file, unsigned int num, int *zeroed)
+{
+    unsigned int chunks = file->header->chunks;
+
+    for (unsigned int c = 0; c < chunks; c++) {
+        ChunkHeader *chunk = (ChunkHeader *)((uintptr_t)file->base + ((uintptr_t)c * CHUNK_SIZE));
+        int first = -1;
+
+        if (chunk->pagesFree < num || (first = findRun(chunk, num)) < 0) {
+            continue;
+        }
+
+        void *page = (void *)((uintptr_t)chunk + ((uintptr_t)first * PAGE_SIZE));
+        PageHeader *header = spanHeader(page);
+
+        // the file was zero filled when it was created and its pages are never purged
+        *zeroed = 1;
+
+        for (unsigned int i = (unsigned int)first; i < (unsigned int)first + num; i++) {
+            uint64_t bit = ((uint64_t)1) << (i % 64);
+
+            if (chunk->dirtyMap[i / 64] & bit) {
+                *zeroed = 0;
+            }
+
+            chunk->freeMap[i / 64] &= ~bit;
+            chunk->spans[i] = header;
+        }
+
+        chunk->pagesFree -= num;
+
+        return page;
+    }
+
+    return NULL;
+}
+
+static void fileRelease(void *page)
+{
+    unsigned int num = classPages[getPageIndex(((PageHeader *)page)->blockSize)];
+    uintptr_t span = spanStart(page);
+    ChunkHeader *chunk = (ChunkHeader *)(span & chunkMask);
+    unsigned int first = (span - (uintptr_t)chunk) >> PAGE_SHIFT;
+
+    for (unsigned int i = first; i < first + num; i++) {
+        chunk->freeMap[i / 64] |= ((uint64_t)1) << (i % 64);
+        chunk->dirtyMap[i / 64] |= ((uint64_t)1) << (i % 64);
+        chunk->spans[i] = NULL;
+    }
+
+    chunk->pagesFree += num;
+}
+
+static void formatFile(ChunkHeader *base, unsigned int chunks)
+{
+    for (unsigned int c = 0; c < chunks; c++) {
+        ChunkHeader *chunk = (ChunkHeader *)((uintptr_t)base + ((uintptr_t)c * CHUNK_SIZE));
+        unsigned int meta = CHUNK_META_PAGES + (c == 0 ? FILE_META_PAGES : 0);
+
+        chunk->kind = SMALL_CHUNK;
+        chunk->node = 0;
+        chunk->pagesFree = CHUNK_PAGES - meta;
+
+        for (unsigned int i = meta; i < CHUNK_PAGES; i++) {
+            chunk->freeMap[i / 64] |= ((uint64_t)1) << (i % 64);
+        }
+    }
+
+    FileHeader *header = (FileHeader *)((uintptr_t)base + (CHUNK_META_PAGES * PAGE_SIZE));
+
+    header->base = (uintptr_t)base;
+    header->size = (size_t)chunks * CHUNK_SIZE;
+    header->chunks = chunks;
+    header->clean = 1;
+    header->pageSize = PAGE_SIZE;
+    header->classes = SIZE_CLASSES;
+    header->classMax = SIZE_CLASS_MAX;
+    header->pageHeader = sizeof(PageHeader);
+    header->chunkHeader = sizeof(ChunkHeader);
+    header->heapSize = sizeof(Heap);
+    header->root = NULL;
+
+    // the magic goes last, a file cut short while being formatted is never taken for a heap
+    header->magic = FILE_MAGIC;
+}
+
+static int fileMatches(const FileHeader *header, uintptr_t base, size_t size)
+{
+    return header->magic == FILE_MAGIC && header->base == base && header->size == size && header->chunks == size / CHUNK_SIZE &&
+        header->clean && header->pageSize == PAGE_SIZE && header->classes == SIZE_CLASSES && header->classMax == SIZE_CLASS_MAX &&
+        header->pageHeader == sizeof(PageHeader) && header->chunkHeader == sizeof(ChunkHeader) && header->heapSize == sizeof(Heap);
+}
+
+static int markFile(PgFile *file, unsigned int kind)
+{
+    int ok = 1;
+
+    for (size_t offset = 0; offset < file->size; offset += CHUNK_SIZE) {
+        ok &= markRegion((char *)file->base + offset, kind);
+    }
+
+    return ok;
+}
+
+static void touchFile(PgFile *file)
+{
+    if (!file->header->clean) {
+        return;
+    }
+
+    // a process ending before the next pgfile_sync() leaves a file that refuses to open
+    file->header->clean = 0;
+    msync(file->base, (CHUNK_META_PAGES + FILE_META_PAGES) * PAGE_SIZE, MS_SYNC);
+}
+
+int pgtrace(const char *path)
+{
+#ifdef PG_TRACE
+    int fd = -1;
+
+    if (path) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&traceLock);
+
+    if (traceFd >= 0) {
+        flushTrace();
+        close(traceFd);
+    }
+
+    traceFd = fd;
+    traceCount = 0;
+    traceStart = nowNs();
+    atomic_store_explicit(&tracing, fd >= 0, memory_order_relaxed);
+
+    pthread_mutex_unlock(&traceLock);
+
+    return 1;
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+static void traceEvent(uint32_t op, const void *ptr, size_t size)
+{
+#ifdef PG_TRACE
+    if (!ptr || !atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        return;
+    }
+
+    if (localThread == 0) {
+        localThread = atomic_fetch_add_explicit(&traceThreads, 1, memory_order_relaxed) + 1;
+    }
+
+    pthread_mutex_lock(&traceLock);
+
+    // the trace may have stopped since tracing was read
+    if (traceFd >= 0) {
+        PgTraceRecord *record = &traceBuffer[traceCount++];
+
+        record->time = nowNs() - traceStart;
+        record->ptr = (uint64_t)(uintptr_t)ptr;
+        record->size = size;
+        record->thread = localThread;
+        record->op = op;
+
+        if (traceCount == TRACE_RECORDS) {
+            flushTrace();
+        }
+    }
+
+    pthread_mutex_unlock(&traceLock);
+#else
+    (void)op;
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+#ifdef PG_TRACE
+static void flushTrace(void)
+{
+    const char *data = (const char *)traceBuffer;
+    size_t left = traceCount * sizeof(PgTraceRecord);
+
+    while (left > 0) {
+        ssize_t wrote = write(traceFd, data, left);
+
+        if (wrote < 0) {
+            // a full disk ends the trace rather than the program
+            atomic_store_explicit(&tracing, 0, memory_order_relaxed);
+            break;
+        }
+
+        data += wrote;
+        left -= (size_t)wrote;
+    }
+
+    traceCount = 0;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+size_t pgprofile(size_t rate)
+{
+    if (rate) {
+        // backtrace() loads its unwinder the first time it runs, better here than in the middle of an allocation
+        void *frame;
+        backtrace(&frame, 1);
+    }
+
+    if (rate) {
+        atomic_store_explicit(&profileLast, rate, memory_order_relaxed);
+    }
+
+    size_t old = atomic_exchange_explicit(&profileRate, rate, memory_order_relaxed);
+
+    // the calling thread picks up the new rate right away, any other once its countdown runs out
+    localRate = rate;
+    pgSampleLeft = rate ? nextSample(rate) : PROFILE_IDLE;
+
+    return old;
+}
+
+int pgprofile_dump(const char *path)
+{
+    char line[PROFILE_LINE];
+    size_t objects = 0;
+    size_t bytes = 0;
+    int ok = 1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    // nothing below allocates while profileLock is held, snprintf() only ever formats integers into line
+    pthread_mutex_lock(&profileLock);
+
+    for (Sample *sample = samples; sample; sample = sample->nextSample) {
+        objects++;
+        bytes += sample->size;
+    }
+
+    // the legacy heap profile of gperftools, the second pair would count every sample ever taken
+    int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu\n", objects, bytes,
+            atomic_load_explicit(&profileLast, memory_order_relaxed));
+    ok &= writeAll(fd, line, (size_t)len);
+
+    for (Sample *sample = samples; sample && ok; sample = sample->nextSample) {
+        len = snprintf(line, sizeof(line), "1: %zu [0: 0] @", sample->size);
+
+        for (unsigned int i = 0; i < sample->depth; i++) {
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " 0x%" PRIxPTR, (uintptr_t)sample->stack[i]);
+        }
+
+        line[len++] = '\n';
+        ok &= writeAll(fd, line, (size_t)len);
+    }
+
+    pthread_mutex_unlock(&profileLock);
+
+    // pprof maps the addresses back to the objects loaded
+    static const char maps[] = "\nMAPPED_LIBRARIES:\n";
+    int mapsFd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+    ok &= writeAll(fd, maps, sizeof(maps) - 1);
+
+    if (mapsFd >= 0) {
+        ssize_t got = 0;
+
+        while (ok && (got = read(mapsFd, line, sizeof(line))) > 0) {
+            ok &= writeAll(fd, line, (size_t)got);
+        }
+        close(mapsFd);
+    }
+
+    ok &= !close(fd);
+
+    return ok;
+}
+
+static inline int countSample(size_t bytes)
+{
+    // compiles to a subtraction and a branch on its borrow
+    if (bytes > pgSampleLeft) {
+        return 1;
+    }
+
+    pgSampleLeft -= bytes;
+    return 0;
+}
+
+__attribute__((noinline)) static void *sampleAlloc(size_t bytes, size_t align, int *zeroed)
+{
+    size_t rate = atomic_load_explicit(&profileRate, memory_order_relaxed);
+
+    if (rate != localRate || rate == 0) {
+        // the countdown ran for another rate or for none, so it is not a sample of this one
+        localRate = rate;
+        pgSampleLeft = rate ? nextSample(rate) : PROFILE_IDLE;
+        return NULL;
+    }
+
+    void *stack[PROFILE_DEPTH + 1];
+
+    // backtrace() may allocate, which must not be sampled in turn
+    pgSampleLeft = SIZE_MAX;
+    int depth = backtrace(stack, PROFILE_DEPTH + 1);
+    pgSampleLeft = nextSample(rate);
+
+    void *ptr = largeAlloc(bytes, align > SAMPLE_OFFSET ? align : SAMPLE_OFFSET, zeroed);
+
+    if (!ptr) {
+        return NULL;
+    }
+
+    LargeHeader *lh = (LargeHeader *)getPage(ptr);
+    Sample *sample = (Sample *)((uintptr_t)lh + LARGE_OFFSET);
+
+    // the first frame is this function
+    sample->size = bytes;
+    sample->depth = depth > 1 ? (unsigned int)depth - 1 : 0;
+    memcpy(sample->stack, stack + 1, sample->depth * sizeof(void *));
+    sample->prevSample = NULL;
+    lh->sampled = 1;
+
+    pthread_mutex_lock(&profileLock);
+    sample->nextSample = samples;
+    if (samples) {
+        samples->prevSample = sample;
+    }
+    samples = sample;
+    pthread_mutex_unlock(&profileLock);
+
+    return ptr;
+}
+
+static void dropSample(void *span)
+{
+    LargeHeader *lh = (LargeHeader *)span;
+    Sample *sample = (Sample *)((uintptr_t)span + LARGE_OFFSET);
+
+    pthread_mutex_lock(&profileLock);
+
+    if (sample->prevSample) {
+        sample->prevSample->nextSample = sample->nextSample;
+    } else {
+        samples = sample->nextSample;
+    }
+
+    if (sample->nextSample) {
+        sample->nextSample->prevSample = sample->prevSample;
+    }
 
-        removeFullList(page);
+    pthread_mutex_unlock(&profileLock);
 
-        headPage = pages[i];
-        ph->nextPage = headPage;
+    lh->sampled = 0;
+}
 
-        if (headPage) {
-            ((PageHeader *)headPage)->prevPage = page;
-        }
+static size_t nextSample(size_t rate)
+{
+    uint64_t x = localSeed;
 
-        pages[i] = page;
+    if (x == 0) {
+        x = (((uint64_t)(uintptr_t)&localSeed * UINT64_C(0x9e3779b97f4a7c15)) ^ nowMs()) | 1;
     }
 
-    if ((ph->freeList) != NULL) {
-        *((uintptr_t *)ptr) = (uintptr_t) (ph->freeList);
-    } else {
-        *((uintptr_t *)ptr) = (uintptr_t) NULL;
-    }
+    // xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    localSeed = x;
 
-    ph->freeList = &(*((uintptr_t *)ptr));
+    // -ln(u) for u uniform in (0, 1], taken as q / 2^26
+    uint64_t q = ((x * UINT64_C(0x2545f4914f6cdd1d)) >> 38) + 1;
+    double next = ((26 * 0.6931471805599453) - fastLog(q)) * (double)rate;
 
-    // ph->freeList should never be NULL at this point
-    assert(ph->freeList);
-    (ph->blocksUsed)--;
+    return next < (double)(SIZE_MAX / 2) ? (size_t)next : SIZE_MAX / 2;
 }
 
-static void *getPage(void *ptr)
+static double fastLog(uint64_t x)
 {
-    void *page = (void *) ((((uintptr_t) ptr) & pageMask));
-    return page;
+    int e = 63 - __builtin_clzll(x);
+    double m = (double)x / (double)(UINT64_C(1) << e);
+
+    // polynomial fit of ln(m) for m in [1, 2)
+    return (e * 0.6931471805599453)
+        + (-1.7417939 + ((2.8212026 + ((-1.4699568 + ((0.44717955 - (0.056570851 * m)) * m)) * m)) * m));
 }
 
-static void *newPage(unsigned int blockSize)
+static int writeAll(int fd, const void *buf, size_t len)
 {
-    void *page = NULL;
+    const char *data = buf;
 
-    /*
-     * Aligned on PAGE_SIZE to make pageMask work in getPage()
-     */
-    if ((posix_memalign(&page, PAGE_SIZE, PAGE_SIZE))) {
-        return NULL;
-    }
+    while (len > 0) {
+        ssize_t wrote = write(fd, data, len);
 
-    page = memset(page, 0, PAGE_SIZE);
-    PageHeader *header = (PageHeader *)page;
+        if (wrote < 0) {
+            return 0;
+        }
 
-    header->blockSize = blockSize;
-    header->blocksUsed = 0;
-    header->freeList = NULL;
-    header->avl = (void *)((uintptr_t)page + PAGE_SIZE);
-    header->nextPage = NULL;
-    header->prevPage = NULL;
+        data += wrote;
+        len -= (size_t)wrote;
+    }
 
-    return page;
+    return 1;
 }
 
-static unsigned int blocksLeft(void *page)
+int pgowns(const void *ptr)
 {
-    return blocksPerPage(page) - ((PageHeader *)page)->blocksUsed;
-}
+    unsigned int kind = regionKind(ptr);
 
-static unsigned int blocksPerPage(void *page)
-{
-    unsigned int blockSize = ((PageHeader *)page)->blockSize;
+    if (kind == REGION_CHUNK) {
+        // nothing else can be mapped inside a chunk
+        return 1;
+    }
+
+    if (kind != REGION_LARGE) {
+        return 0;
+    }
+
+    /*
+     * A large span may be smaller than its region and share it with memory mapped by someone else,
+     * so only the block itself is ours. largeLock keeps the span from being unmapped while it is checked.
+     */
+    int owned = 0;
 
-    return (PAGE_SIZE - sizeof(PageHeader)) / blockSize;
+    pthread_mutex_lock(&largeLock);
+    if (regionKind(ptr) == REGION_LARGE) {
+        LargeHeader *lh = (LargeHeader *)(((uintptr_t)ptr) & chunkMask);
+        owned = ((uintptr_t)ptr == ((uintptr_t)lh) + lh->offset);
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    return owned;
 }
 
-void *pgalloc(size_t bytes)
+size_t pgusable_size(void *ptr)
 {
-    void *page = NULL;
+    if (ptr == NULL) {
+        return 0;
+    }
 
-    if (bytes > maxPageData) {
-        // currently do not have a way to span multiple pages
-        return NULL;
+    void *page = getPage(ptr);
+
+    if (isLargePage(page)) {
+        return ((LargeHeader *)page)->spanSize - ((LargeHeader *)page)->offset;
     }
 
-    unsigned int index = getPageIndex(bytes);
+    return ((PageHeader *)page)->blockSize;
+}
 
-    if (index >= PAGES) {
-        //NOTE: here is where we would start using the best fit algorithm, refer to issue #1 in Gitea.
-        return NULL;
+static void *allocBlock(Heap *heap, unsigned int index, size_t bytes, int *zeroed)
+{
+    void *page = heap->pages[index];
+
+    countAdd(&(heap->stats[index].allocs), 1);
+    countAdd(&(heap->stats[index].requested), bytes);
+
+    if (page == NULL) {
+        // carry on with the fullest page that has blocks left
+        page = unparkPage(heap, index);
     }
 
-    page = pages[index];
+    if (page == NULL && heap->emptyPages[index]) {
+        // reuse an empty page kept by retirePage()
+        page = heap->emptyPages[index];
+        unlinkPage(&(heap->emptyPages[index]), page);
+        heap->emptyCount[index]--;
+        pushPage(&(heap->pages[index]), page);
+    }
 
     if (page == NULL) {
         // allocate new page
 
-        page = newPage((index + 1) * BBLOCK_SIZE);
+        page = newPage(heap, index);
         if (!page) {
+            countSub(&(heap->stats[index].allocs), 1);
+            countSub(&(heap->stats[index].requested), bytes);
             return NULL;
         }
-        PageHeader *ph = (PageHeader *)page;
+        pushPage(&(heap->pages[index]), page);
+    }
+
+    PageHeader *ph = (PageHeader *)page;
+    int fresh = 0;
+    void *ptr = popBlock(page, &fresh);
 
-        ph->blocksUsed++;
-        ph->avl = (void *)((uintptr_t)(ph->avl) - ph->blockSize);
+    (ph->blocksUsed)++;
 
-        if (blocksLeft(page) == 0) {
-            // it was the maximum request per page!
-            addFullList(page);
-        } else {
-            pages[index] = page;
-        }
+    if ((blocksLeft(page)) == 0) {
+        /* will either be NULL or if there are
+         * partially free pages we'll start filling those
+         * before creating a whole new page
+         */
+        unlinkPage(&(heap->pages[index]), page);
+        addFullList(heap, page);
+    }
 
-        // at this point we should NEVER return a NULL pointer
-        assert((ph->avl));
-        return (ph->avl);
+    if (zeroed) {
+        // blocks below avl have never been handed out
+        *zeroed = fresh ? ph->flags & PAGE_ZEROED : 0;
     }
 
-    unsigned int remainingBlocks = blocksLeft(page);
+    // at this point we should NEVER return a NULL pointer
+    assert(ptr);
+    return ptr;
+}
+
+static void *popBlock(void *page, int *fresh)
+{
     PageHeader *ph = (PageHeader *)page;
 
+#ifdef PG_BITMAP_PAGES
+    unsigned int w = 0;
+
+    while (ph->bitmap[w] == ~UINT64_C(0)) {
+        w++;
+        assert(w < BITMAP_WORDS);
+    }
+
+    unsigned int bit = (unsigned int)__builtin_ctzll(~(ph->bitmap[w]));
+    void *ptr = (void *)(spanEnd(page) - ((size_t)((64 * w) + bit + 1) * ph->blockSize));
+
+    ph->bitmap[w] |= UINT64_C(1) << bit;
+
+    // the lowest clear bit only lies below avl once every block above it is in use
+    *fresh = ptr < ph->avl;
+    if (*fresh) {
+        ph->avl = ptr;
+    }
+
+    return ptr;
+#else
     if (ph->freeList) {
         // there are free blocks in the list
-        void *ptr = NULL;
+        void *ptr = ph->freeList;
 
-        ptr = ph->freeList;
         ph->freeList = (void *) *((uintptr_t **)(ph->freeList));
+        *fresh = 0;
+
+        return ptr;
+    }
+
+    ph->avl = (void *)((uintptr_t)ph->avl - ph->blockSize);
+    *fresh = 1;
+
+    return ph->avl;
+#endif
+}
+
+static void *availPage(Heap *heap, unsigned int index)
+{
+    void *page = heap->pages[index];
 
-        (ph->blocksUsed)++;
+    if (page || (page = unparkPage(heap, index))) {
+        return page;
+    }
 
-        if ((blocksLeft(page)) == 0) {
-            pages[index] = ((PageHeader *)page)->nextPage;
-            addFullList(page);
+    if (heap->emptyPages[index]) {
+        page = heap->emptyPages[index];
+        unlinkPage(&(heap->emptyPages[index]), page);
+        heap->emptyCount[index]--;
+    } else {
+        page = newPage(heap, index);
+        if (!page) {
+            return NULL;
         }
+    }
 
-        return ptr;
+    pushPage(&(heap->pages[index]), page);
+
+    return page;
+}
+
+static size_t takeBlocks(void *page, void **out, size_t num)
+{
+    PageHeader *ph = (PageHeader *)page;
+    size_t left = blocksLeft(page);
+    size_t taken = 0;
+
+    if (num > left) {
+        num = left;
     }
 
-    if (remainingBlocks >= 2) {
-        // add block to page
-        ph->blocksUsed++;
-        ph->avl = (void *)((uintptr_t)ph->avl - ph->blockSize);
+#ifdef PG_BITMAP_PAGES
+    int fresh = 0;
 
-        return (ph->avl);
-    } else if (remainingBlocks == 1) {
-        // need to move to a new page
-        ph->blocksUsed++;
-        ph->avl = (void *)((uintptr_t)ph->avl - ph->blockSize);
+    while (taken < num) {
+        out[taken++] = popBlock(page, &fresh);
+    }
+#else
+    while (taken < num && ph->freeList) {
+        out[taken++] = ph->freeList;
+        ph->freeList = (void *) *((uintptr_t **)(ph->freeList));
+    }
 
-        /* will either be NULL or if there are
-         * partially free pages we'll start filling those
-         * before creating a whole new page
-         */
-        pages[index] = ((PageHeader *)page)->nextPage;
-        addFullList(page);
+    // every block left once the free list is empty lies below avl
+    uintptr_t avl = (uintptr_t)ph->avl;
 
-        return ((PageHeader *)page)->avl;
+    while (taken < num) {
+        avl -= ph->blockSize;
+        out[taken++] = (void *)avl;
     }
 
-    // should NEVER get here
-    assert(NULL);
-    return NULL;
+    ph->avl = (void *)avl;
+#endif
+    ph->blocksUsed += (unsigned short)num;
+
+    return num;
 }
 
-// cppcheck-suppress unusedFunction
 void pgview(void)
 {
-    void *curFullPage = fullPages;
+    Heap *heap = localHeap;
 
-    for (int i = 0; i < PAGES; i++) {
-        void *page = pages[i];
-        void *startPage = pages[i];
+    if (heap) {
+        viewHeap(heap);
+    }
 
-        if (page == NULL) {
-            continue;
+    // pages handed back by threads that have exited
+    pthread_mutex_lock(&poolLock);
+    viewHeap(&pool);
+    pthread_mutex_unlock(&poolLock);
+
+    pthread_mutex_lock(&largeLock);
+    for (void *span = largeSpans; span; span = ((LargeHeader *)span)->nextSpan) {
+        printf("Span at[%p] size[%zu]\n", span, ((LargeHeader *)span)->spanSize);
+    }
+    pthread_mutex_unlock(&largeLock);
+}
+
+static void viewHeap(Heap *heap)
+{
+    walkHeap(heap, printPage, NULL);
+}
+
+static int walkHeap(Heap *heap, int (*visit)(void *, void *), void *arg)
+{
+    int ret = 0;
+
+    for (int i = 0; i < SIZE_CLASSES && !ret; i++) {
+        for (void *page = heap->pages[i]; page && !ret; page = ((PageHeader *)page)->nextPage) {
+            ret = visit(page, arg);
         }
 
-        do {
-            printPage(page);
-            page = ((PageHeader *)page)->nextPage;
-            if (page == startPage) {
-                break;
+        for (unsigned int b = 0; b < PARTIAL_BUCKETS && !ret; b++) {
+            for (void *page = heap->partialPages[i][b]; page && !ret; page = ((PageHeader *)page)->nextPage) {
+                ret = visit(page, arg);
             }
-        } while (page);
+        }
     }
 
-    // print full pages
-    while (curFullPage) {
-        printPage(curFullPage);
-        curFullPage = ((PageHeader *)curFullPage)->nextPage;
-        if (curFullPage == fullPages) {
-            // made one full cycle
-            break;
+    // full pages
+    for (void *page = heap->fullPages; page && !ret; page = ((PageHeader *)page)->nextPage) {
+        ret = visit(page, arg);
+    }
+
+    // empty pages kept for reuse
+    for (int i = 0; i < SIZE_CLASSES && !ret; i++) {
+        for (void *page = heap->emptyPages[i]; page && !ret; page = ((PageHeader *)page)->nextPage) {
+            ret = visit(page, arg);
         }
     }
+
+    return ret;
 }
 
-static void printPage(void *page)
+static int printPage(void *page, void *arg)
 {
+    (void)arg;
+
     PageHeader *ph = (PageHeader *)page;
+#ifdef PG_BITMAP_PAGES
+    unsigned int carved = (unsigned int)((spanEnd(page) - (uintptr_t)ph->avl) / ph->blockSize);
+#else
     void *freeBlock = ph->freeList;
+#endif
 
-    printf("Page at[%p] ", page);
+    printf("Page at[%p] ", (void *)spanStart(page));
     printf("size[%u] ", ph->blockSize);
+    printf("pages[%u] ", classPages[getPageIndex(ph->blockSize)]);
     printf("max[%u] ", blocksPerPage(page));
     printf("used[%u] ", ph->blocksUsed);
     printf("avl[%p] ", ph->avl);
 
+#ifdef PG_BITMAP_PAGES
+    printf(" free[");
+    for (unsigned int i = 0; i < carved; i++) {
+        if (!(ph->bitmap[i / 64] & (UINT64_C(1) << (i % 64)))) {
+            printf("%p ", (void *)(spanEnd(page) - ((size_t)(i + 1) * ph->blockSize)));
+        }
+    }
+    printf("]\n");
+#else
     if (freeBlock) {
         printf(" free[");
         while (freeBlock) {
@@ -338,62 +4009,330 @@ static void printPage(void *page)
     } else {
         printf(" free[]\n");
     }
+#endif
+
+    return 0;
 }
 
-static void addFullList(void *page)
+static void pushPage(void **list, void *page)
 {
     PageHeader *ph = (PageHeader *)page;
+    PageHeader *headPage = (PageHeader *)*list;
 
-    if (fullPages == NULL) {
-        ph->nextPage = NULL;
-        ph->prevPage = NULL;
-        ph->freeList = NULL;
-
-        fullPages = page;
-    } else {
-        PageHeader *headPage = (PageHeader *)fullPages;
-        PageHeader *prevPage = NULL;
-
-        ph->freeList = NULL;
-        ph->nextPage = fullPages;
+    ph->prevPage = NULL;
+    ph->nextPage = headPage;
 
-        if ((headPage->prevPage) == NULL) {
-            // list only has a single page
-            ph->prevPage = fullPages;
-            headPage->nextPage = page;
-            headPage->prevPage = page;
-        } else {
-            prevPage = headPage->prevPage;
-            prevPage->nextPage = page;
-            ph->prevPage = prevPage;
-            headPage->prevPage = page;
-        }
+    if (headPage) {
+        headPage->prevPage = page;
     }
+
+    *list = page;
 }
 
-static void *removeFullList(void *page)
+static void unlinkPage(void **list, void *page)
 {
     PageHeader *ph = (PageHeader *)page;
     PageHeader *nph = (PageHeader *)ph->nextPage;
     PageHeader *pph = (PageHeader *)ph->prevPage;
 
-    if (nph != NULL && pph != NULL) {
-        nph->prevPage = ph->prevPage;
+    if (pph != NULL) {
         pph->nextPage = ph->nextPage;
-    } else if (nph != NULL) {
-        nph->prevPage = ph->prevPage;
-    } else if (pph != NULL) {
-        pph->prevPage = ph->nextPage;
+    } else {
+        *list = ph->nextPage;
     }
 
-    fullPages = ((PageHeader *)fullPages)->nextPage;
+    if (nph != NULL) {
+        nph->prevPage = ph->prevPage;
+    }
 
     ph->prevPage = NULL;
     ph->nextPage = NULL;
+}
+
+static void addFullList(Heap *heap, void *page)
+{
+    PageHeader *ph = (PageHeader *)page;
+
+    ph->freeList = NULL;
+#ifndef PG_NO_FULL_LIST
+    pushPage(&(heap->fullPages), page);
+#endif
+    countAdd(&(heap->stats[getPageIndex(ph->blockSize)].fullPages), 1);
+}
+
+static void *removeFullList(Heap *heap, void *page)
+{
+#ifndef PG_NO_FULL_LIST
+    unlinkPage(&(heap->fullPages), page);
+#endif
+    countSub(&(heap->stats[getPageIndex(((PageHeader *)page)->blockSize)].fullPages), 1);
 
     return page;
 }
 
+size_t pgtrim(void)
+{
+    size_t bytes = 0;
+    Heap *heap = localHeap;
+
+    if (heap) {
+        collectRemote(heap);
+        releaseEmptyPages(heap);
+    }
+
+    pthread_mutex_lock(&poolLock);
+    collectPool();
+    pthread_mutex_unlock(&poolLock);
+
+    pthread_mutex_lock(&chunkLock);
+    bytes += decayChunks(1);
+    pthread_mutex_unlock(&chunkLock);
+
+    pthread_mutex_lock(&largeLock);
+    for (unsigned int i = 0; i < LARGE_CACHE_CLASSES; i++) {
+        while (spanCache[i]) {
+            void *span = spanCache[i];
+            size_t size = ((LargeHeader *)span)->spanSize;
+
+            unlinkSpan(&spanCache[i], span);
+            spanCacheBytes -= size;
+            spanCacheCount--;
+            unmapSpan(span);
+            bytes += size;
+        }
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    return bytes;
+}
+
+// cppcheck-suppress unusedFunction
+void pgdecay(unsigned int ms, unsigned int pages)
+{
+    pthread_mutex_lock(&chunkLock);
+    decayMs = ms;
+    maxDirtyPages = pages;
+    pthread_mutex_unlock(&chunkLock);
+}
+
+size_t pgwalk(PgWalkCallback callback, void *ctx)
+{
+    WalkState state = { callback, ctx, 0, 0, 0 };
+    Heap *heap = localHeap;
+    int stop = 0;
+
+    if (heap) {
+        collectRemote(heap);
+        stop = walkHeap(heap, walkPage, &state);
+    }
+
+    if (!stop) {
+        // a cache is read under its own lock like any thread using it
+        state.cache = 1;
+        pthread_mutex_lock(&cacheLock);
+        for (PgCache *cache = caches; cache && !stop; cache = cache->nextCache) {
+            pthread_mutex_lock(&(cache->lock));
+            stop = walkHeap(cache->heap, walkPage, &state);
+            pthread_mutex_unlock(&(cache->lock));
+        }
+        pthread_mutex_unlock(&cacheLock);
+        state.cache = 0;
+    }
+
+    if (!stop) {
+        // pages handed back by threads that have exited
+        state.pool = 1;
+        pthread_mutex_lock(&poolLock);
+        stop = walkHeap(&pool, walkPage, &state);
+        pthread_mutex_unlock(&poolLock);
+    }
+
+    if (!stop) {
+        // arena spans are listed whole, their blocks are never looked at
+        pthread_mutex_lock(&chunkLock);
+        for (PgArena *arena = arenas; arena && !stop; arena = arena->nextArena) {
+            stop = walkArenaSpan(&state, arena, ARENA_PAGES);
+            for (ArenaSpan *span = arena->spans; span && !stop; span = span->nextSpan) {
+                stop = walkArenaSpan(&state, span, span->pages);
+            }
+        }
+        pthread_mutex_unlock(&chunkLock);
+    }
+
+    if (!stop) {
+        pthread_mutex_lock(&largeLock);
+        for (void *span = largeSpans; span && !stop; span = ((LargeHeader *)span)->nextSpan) {
+            LargeHeader *lh = (LargeHeader *)span;
+            PgWalkPage info = { 0 };
+
+            info.page = span;
+            info.spanBytes = lh->spanSize;
+            info.blockSize = lh->spanSize - lh->offset;
+            info.maxBlocks = 1;
+            info.usedBlocks = 1;
+            info.large = 1;
+            info.node = -1;
+
+            state.pages++;
+            stop = callback(&info, ctx);
+        }
+        pthread_mutex_unlock(&largeLock);
+    }
+
+    return state.pages;
+}
+
+static int walkPage(void *page, void *arg)
+{
+    WalkState *state = (WalkState *)arg;
+    PageHeader *ph = (PageHeader *)page;
+    PgWalkPage info = { 0 };
+
+    info.page = (void *)spanStart(page);
+    info.spanBytes = (size_t)classPages[getPageIndex(ph->blockSize)] * PAGE_SIZE;
+    info.blockSize = ph->blockSize;
+    info.maxBlocks = blocksPerPage(page);
+    info.usedBlocks = ph->blocksUsed;
+    info.freeBlocks = PgFreeBlocks(ph);
+    info.tailBytes = info.spanBytes - SPAN_HEADER - ((size_t)info.maxBlocks * ph->blockSize);
+    info.node = (int)((ChunkHeader *)(((uintptr_t)page) & chunkMask))->node;
+    info.pool = state->pool;
+    info.cache = state->cache;
+
+    state->pages++;
+    return state->callback(&info, state->ctx);
+}
+
+static int walkArenaSpan(WalkState *state, void *span, unsigned int pages)
+{
+    PgWalkPage info = { 0 };
+
+    info.page = span;
+    info.spanBytes = (size_t)pages * PAGE_SIZE;
+    info.blockSize = info.spanBytes - ARENA_HEADER;
+    info.maxBlocks = 1;
+    info.usedBlocks = 1;
+    info.arena = 1;
+    info.node = (int)((ChunkHeader *)(((uintptr_t)span) & chunkMask))->node;
+
+    state->pages++;
+    return state->callback(&info, state->ctx);
+}
+
+void pgfrag(PgFragStats *frag)
+{
+    memset(frag, 0, sizeof(*frag));
+    frag->classes = SIZE_CLASSES;
+
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        frag->sizeClass[i].blockSize = classSize[i];
+    }
+
+    pgwalk(fragPage, frag);
+
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        PgFragClass *fc = &(frag->sizeClass[i]);
+
+        // pages left if the blocks in use were packed as tightly as possible
+        size_t needed = (fc->usedBlocks + classBlocks[i] - 1) / classBlocks[i];
+
+        fc->reclaimablePages = fc->pages - needed;
+    }
+}
+
+static int fragPage(const PgWalkPage *info, void *arg)
+{
+    PgFragStats *frag = (PgFragStats *)arg;
+
+    if (info->large || info->arena) {
+        return 0;
+    }
+
+    PgFragClass *fc = &(frag->sizeClass[getPageIndex((unsigned int)info->blockSize)]);
+    unsigned int bucket = 0;
+
+    if (info->usedBlocks) {
+        // round up so only empty pages land in bucket 0
+        bucket = ((info->usedBlocks * (PG_FRAG_BUCKETS - 1)) + info->maxBlocks - 1) / info->maxBlocks;
+    }
+
+    fc->pages++;
+    fc->utilization[bucket]++;
+    fc->usedBlocks += info->usedBlocks;
+    fc->freeBytes += (size_t)(info->maxBlocks - info->usedBlocks) * info->blockSize;
+    fc->tailBytes += info->tailBytes;
+
+    return 0;
+}
+
+void pgstats(PgStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->classes = SIZE_CLASSES;
+
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        stats->sizeClass[i].blockSize = classSize[i];
+    }
+
+    pthread_mutex_lock(&poolLock);
+
+    sumStats(stats, &pool);
+    for (Heap *heap = allHeaps; heap; heap = heap->nextAll) {
+        sumStats(stats, heap);
+    }
+
+    pthread_mutex_unlock(&poolLock);
+
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        PgClassStats *out = &(stats->sizeClass[i]);
+
+        // counters are summed over heaps, where a page may have moved to the pool, so only the totals add up
+        out->usedBlocks = out->allocs - out->frees;
+        out->allocatedBytes = out->allocs * classSize[i];
+        out->reservedBytes = out->pages * classPages[i] * PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&largeLock);
+    stats->largeSpans = largeCount;
+    stats->largeBytes = largeBytes;
+    stats->cachedSpans = spanCacheCount;
+    stats->cachedBytes = spanCacheBytes;
+    stats->largeAllocs = largeAllocs;
+    stats->largeFrees = largeFrees;
+    pthread_mutex_unlock(&largeLock);
+
+    pthread_once(&numaOnce, findNodes);
+    stats->nodes = numaNodes < NUMA_NODES ? numaNodes : NUMA_NODES;
+
+    pthread_mutex_lock(&chunkLock);
+    for (unsigned int i = 0; i < NUMA_NODES; i++) {
+        NodePool *np = &(nodePools[i]);
+
+        stats->node[i].chunks = np->chunkCount;
+        stats->node[i].freePages = np->pagesFree;
+        stats->node[i].usedPages = (np->chunkCount * (CHUNK_PAGES - CHUNK_META_PAGES)) - np->pagesFree;
+        if (np->chunkCount && i >= stats->nodes) {
+            stats->nodes = i + 1;
+        }
+    }
+    pthread_mutex_unlock(&chunkLock);
+}
+
+static void sumStats(PgStats *stats, Heap *heap)
+{
+    for (unsigned int i = 0; i < SIZE_CLASSES; i++) {
+        ClassStats *cs = &(heap->stats[i]);
+        PgClassStats *out = &(stats->sizeClass[i]);
+
+        out->allocs += atomic_load_explicit(&(cs->allocs), memory_order_relaxed);
+        out->frees += atomic_load_explicit(&(cs->frees), memory_order_relaxed);
+        out->requestedBytes += atomic_load_explicit(&(cs->requested), memory_order_relaxed);
+        out->newPages += atomic_load_explicit(&(cs->newPages), memory_order_relaxed);
+        out->pages += atomic_load_explicit(&(cs->pages), memory_order_relaxed);
+        out->fullPages += atomic_load_explicit(&(cs->fullPages), memory_order_relaxed);
+    }
+}
+
 PageHeader *PgPageInfo(void *p)
 {
     if (p) {
@@ -406,6 +4345,10 @@ PageHeader *PgPageInfo(void *p)
 
 unsigned int PgUsedBlocks(PageHeader *ph)
 {
+    if (ph && isLargePage(ph)) {
+        return 1;
+    }
+
     if (ph) {
         return ph->blocksUsed;
     }
@@ -415,6 +4358,11 @@ unsigned int PgUsedBlocks(PageHeader *ph)
 
 unsigned int PgBlockSize(PageHeader *ph)
 {
+    if (ph && isLargePage(ph)) {
+        size_t size = ((LargeHeader *)ph)->spanSize - ((LargeHeader *)ph)->offset;
+        return size > UINT_MAX ? UINT_MAX : (unsigned int)size;
+    }
+
     if (ph) {
         return ph->blockSize;
     }
@@ -424,6 +4372,10 @@ unsigned int PgBlockSize(PageHeader *ph)
 
 unsigned int PgMaxBlocks(PageHeader *ph)
 {
+    if (ph && isLargePage(ph)) {
+        return 1;
+    }
+
     if (ph) {
         return blocksPerPage(ph);
     }
@@ -433,16 +4385,12 @@ unsigned int PgMaxBlocks(PageHeader *ph)
 
 unsigned int PgFreeBlocks(PageHeader *ph)
 {
-    void *freeBlock = ph->freeList;
-    if (freeBlock) {
-        unsigned int num = 0;
-        while (freeBlock) {
-            num++;
-            freeBlock = (void *) *((uintptr_t **)freeBlock);
-        }
-
-        return num;
+    if (isLargePage(ph)) {
+        return 0;
     }
 
-    return 0;
+    // every block from avl up has been handed out, and those not in use have been freed back
+    unsigned int carved = (unsigned int)((spanEnd(ph) - (uintptr_t)ph->avl) / ph->blockSize);
+
+    return carved - ph->blocksUsed;
 }
@@ -1,11 +1,58 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <setjmp.h>
 #include <cmocka.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <pgalloc.h>
 
+// bitmap pages carry BITMAP_WORDS more words in their PageHeader, see scripts/sizeclasses
+#if defined(PG_HEADER_TABLE)
+#define PAGE_DATA 8192
+#elif defined(PG_BITMAP_PAGES)
+#define PAGE_DATA (8192 - 192)
+#else
+#define PAGE_DATA (8192 - 64)
+#endif
+
 #define LEN 64
+#define THREADS 8
+#define THREAD_BLOCKS 512
+#define THREAD_ROUNDS 16
+#define REMOTE_SIZE 200
+#define QUEUE_LEN 256
+#define QUEUE_ITEMS 65536
+#define TRIM_BLOCKS 2048
+#define TRIM_SIZE PAGE_DATA
+#define MIB (1024 * 1024)
+#define STATS_BLOCKS 1000
+#define STATS_SIZE 700
+#define FRAG_BLOCKS 400
+#define FRAG_SIZE 1500
+#define BULK_BLOCKS 1000
+#define BULK_SIZE 48
+#define ARENA_BLOCKS 10000
+#define ARENA_SIZE 40
+#define CACHE_OBJECTS 500
+#define FILE_PATH "pgalloc-test.heap"
+// above where the kernel places position independent executables and their heap, and clear of sanitizer mappings
+#define FILE_BASE ((void *)0x567000000000)
+#define FILE_SIZE (4 * MIB)
+#define FILE_NODES 1000
+#define TRACE_PATH "pgalloc-test.trace"
+#define PROFILE_PATH "pgalloc-test.profile"
+#define PROFILE_BLOCKS 16
+#define PROFILE_SIZE 100
+#define CACHE_MAGIC 0x5ca1ab1eU
+#define BITMAP_SIZE 112
+#define NODE_BLOCKS 256
+#define NODE_SIZE 1024
+#define PACK_PAGES 3
+#define PACK_SIZE 1024
 
 typedef struct Node Node;
 struct Node {
@@ -33,6 +80,41 @@ static Node *NewNode(void)
     return n;
 }
 
+typedef struct Worker Worker;
+struct Worker {
+    pthread_t thread;
+    unsigned int id;
+    int ok;
+    unsigned int *kept[LEN]; // blocks left behind for the main thread to free
+};
+
+typedef struct Queue Queue;
+struct Queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int *items[QUEUE_LEN];
+    unsigned int head;
+    unsigned int tail;
+    int done;
+    int ok;
+};
+
+static size_t residentBytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long size = 0;
+    unsigned long resident = 0;
+
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+
+    return resident * 4096;
+}
+
 static Node **nodes;
 static char **oddNodes;
 
@@ -102,8 +184,8 @@ static void test_blocks_first_alloc(void **state)
     assert_true(64 == PgBlockSize(phNode));
     assert_true(512 == PgBlockSize(phArr));
 
-    assert_true(127 == PgMaxBlocks(phNode));
-    assert_true(15 == PgMaxBlocks(phArr));
+    assert_true((PAGE_DATA / 64) == PgMaxBlocks(phNode));
+    assert_true((PAGE_DATA / 512) == PgMaxBlocks(phArr));
 
     assert_true(0 == PgFreeBlocks(phNode));
     assert_true(0 == PgFreeBlocks(phArr));
@@ -126,8 +208,8 @@ static void test_blocks_free_half(void **state)
     assert_true(64 == PgBlockSize(phNode));
     assert_true(512 == PgBlockSize(phArr));
 
-    assert_true(127 == PgMaxBlocks(phNode));
-    assert_true(15 == PgMaxBlocks(phArr));
+    assert_true((PAGE_DATA / 64) == PgMaxBlocks(phNode));
+    assert_true((PAGE_DATA / 512) == PgMaxBlocks(phArr));
 
     assert_true(32 == PgFreeBlocks(phNode));
     assert_true(0 == PgFreeBlocks(phArr));
@@ -153,8 +235,8 @@ static void test_blocks_realloc(void **state)
     assert_true(64 == PgBlockSize(phNode));
     assert_true(512 == PgBlockSize(phArr));
 
-    assert_true(127 == PgMaxBlocks(phNode));
-    assert_true(15 == PgMaxBlocks(phArr));
+    assert_true((PAGE_DATA / 64) == PgMaxBlocks(phNode));
+    assert_true((PAGE_DATA / 512) == PgMaxBlocks(phArr));
 
     assert_true(0 == PgFreeBlocks(phNode));
     assert_true(0 == PgFreeBlocks(phArr));
@@ -172,8 +254,8 @@ static void test_blocks_first_odd_alloc(void **state)
     assert_true(64 == PgBlockSize(phNode));
     assert_true(512 == PgBlockSize(phArr));
 
-    assert_true(127 == PgMaxBlocks(phNode));
-    assert_true(15 == PgMaxBlocks(phArr));
+    assert_true((PAGE_DATA / 64) == PgMaxBlocks(phNode));
+    assert_true((PAGE_DATA / 512) == PgMaxBlocks(phArr));
 
     assert_true(0 == PgFreeBlocks(phNode));
     assert_true(0 == PgFreeBlocks(phArr));
@@ -182,7 +264,7 @@ static void test_blocks_first_odd_alloc(void **state)
 // When alloc requests create multiple pages for a single block size the calls should succeed.
 static void test_blocks_span_pages(void **state)
 {
-    const unsigned int num = 16;
+    const unsigned int num = (PAGE_DATA / 512) + 1;
     void **bigArr = pgalloc(sizeof(*bigArr) * num);
 
     for (unsigned int i = 0; i < num; i++) {
@@ -191,15 +273,15 @@ static void test_blocks_span_pages(void **state)
 
     PageHeader *ph0 = PgPageInfo(bigArr[0]);
 
-    assert_true(15 == PgUsedBlocks(ph0));
+    assert_true((num - 1) == PgUsedBlocks(ph0));
     assert_true(512 == PgBlockSize(ph0));
-    assert_true(15 == PgMaxBlocks(ph0));
+    assert_true((num - 1) == PgMaxBlocks(ph0));
     assert_true(0 == PgFreeBlocks(ph0));
 
-    PageHeader *ph1 = PgPageInfo(bigArr[15]);
+    PageHeader *ph1 = PgPageInfo(bigArr[num - 1]);
     assert_true(1 == PgUsedBlocks(ph1));
     assert_true(512 == PgBlockSize(ph1));
-    assert_true(15 == PgMaxBlocks(ph1));
+    assert_true((num - 1) == PgMaxBlocks(ph1));
     assert_true(0 == PgFreeBlocks(ph1));
 
     for (unsigned int i = 0; i < num; i++) {
@@ -211,40 +293,931 @@ static void test_blocks_span_pages(void **state)
 // When the maximum byte request per-page is passed to pgalloc the call should succeed.
 static void test_max_block_per_page(void **state)
 {
-    // NOTE: need to recompute this if the PageHeader or PAGE_SIZE changes.
-    // based on 8192 - sizeof(PageHeader) where sizeof(PageHeader) == 40 bytes.
-    void *big = pgalloc(8152);
+    // NOTE: need to recompute PAGE_DATA if the PageHeader or PAGE_SIZE changes.
+    // based on 8192 - sizeof(PageHeader) where sizeof(PageHeader) == 64 bytes.
+    void *big = pgalloc(PAGE_DATA);
     assert_true(NULL != big);
-    void *biggie = pgalloc(8152);
+    void *biggie = pgalloc(PAGE_DATA);
     assert_true(NULL != biggie);
 
     pgfree(big);
-    big = pgalloc(8152);
+    big = pgalloc(PAGE_DATA);
     assert_true(NULL != big);
 
     pgfree(big);
     pgfree(biggie);
 }
 
-// When greater than the maximum byte request per-page is passed to pgalloc the call should return NULL.
+// When greater than the maximum byte request per-page is passed to pgalloc the call should be served from a large span.
 static void test_greater_than_max_request_per_page(void **state)
 {
-    void *big = pgalloc(8153);
-    assert_true(NULL == big);
+    unsigned char *big = pgalloc(8129);
+    assert_true(NULL != big);
+
+    PageHeader *ph = PgPageInfo(big);
+    assert_true(1 == PgUsedBlocks(ph));
+    assert_true(1 == PgMaxBlocks(ph));
+    assert_true(0 == PgFreeBlocks(ph));
+    assert_true(8129 <= PgBlockSize(ph));
+
+    for (int i = 0; i < 8129; i++) {
+        big[i] = (unsigned char)i;
+    }
+    for (int i = 0; i < 8129; i++) {
+        assert_true((unsigned char)i == big[i]);
+    }
+
     pgfree(big);
 }
 
-// When a byte request exceeds the maximum page index, NULL is returned.
+// When a byte request exceeds the maximum page index, a large span is returned.
 static void test_maximum_page_index(void **state)
 {
-    // NOTE: due to the current design, the maximum possible page index is 1019 from a byte request of 8152.
-    // This is because beyond 8152 bytes, we hit a maximum byte request, therefore never stress the maximum page index.
+    // NOTE: due to the current design, the largest size class holds a byte request of 8128.
+    // This is because beyond 8128 bytes requests are served by large spans, therefore never stress the maximum page index.
     // This test is in place should circumstances ever change.
     void *big = pgalloc(8200);
-    assert_true(NULL == big);
+    assert_true(NULL != big);
+    assert_true(8200 <= PgBlockSize(PgPageInfo(big)));
     pgfree(big);
 }
 
+// When requests of every small size are made each should land in a class that wastes at most a quarter of its block.
+static void test_size_classes(void **state)
+{
+    unsigned int classes = 0;
+    unsigned int lastSize = 0;
+
+    for (unsigned int bytes = 1; bytes <= PAGE_DATA; bytes++) {
+        void *p = pgalloc(bytes);
+        assert_true(NULL != p);
+
+        unsigned int size = PgBlockSize(PgPageInfo(p));
+        assert_true(size >= bytes);
+        if (bytes > 128) {
+            assert_true((size - bytes) * 4 < size);
+        }
+
+        if (size != lastSize) {
+            assert_true(size > lastSize);
+            lastSize = size;
+            classes++;
+        }
+
+        pgfree(p);
+    }
+
+    assert_true(classes <= 40);
+}
+
+// When a size class uses a span of several pages every block in the span should share one PageHeader.
+static void test_multi_page_span(void **state)
+{
+    char *blocks[3];
+
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = pgalloc(4100);
+        assert_true(NULL != blocks[i]);
+        memset(blocks[i], i, 4100);
+    }
+
+    PageHeader *ph = PgPageInfo(blocks[0]);
+
+    assert_true(5120 == PgBlockSize(ph));
+    assert_true(3 == PgMaxBlocks(ph));
+    assert_true(3 == PgUsedBlocks(ph));
+
+    for (int i = 1; i < 3; i++) {
+        assert_true(ph == PgPageInfo(blocks[i]));
+        // any pointer into the block finds the same header
+        assert_true(ph == PgPageInfo(blocks[i] + 4099));
+    }
+
+    // blocks cross page boundaries, so they must not overlap
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4100; j++) {
+            assert_true(i == blocks[i][j]);
+        }
+    }
+
+    pgfree(blocks[1]);
+    assert_true(2 == PgUsedBlocks(ph));
+    assert_true(1 == PgFreeBlocks(ph));
+
+    blocks[1] = pgalloc(5000);
+    assert_true(ph == PgPageInfo(blocks[1]));
+
+    for (int i = 0; i < 3; i++) {
+        pgfree(blocks[i]);
+    }
+}
+
+// When a large block is freed its span should be reused by the next request of a similar size.
+static void test_large_span_cache(void **state)
+{
+    const size_t sizes[] = { 16 * 1024, 100 * 1000, 1000 * 1000 };
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char *big = pgalloc(sizes[i]);
+        assert_true(NULL != big);
+        big[0] = 'a';
+        big[sizes[i] - 1] = 'z';
+
+        pgfree(big);
+
+        char *again = pgalloc(sizes[i] - 1);
+        assert_true(big == again);
+        pgfree(again);
+    }
+
+    // too large to be cached, must still work
+    char *huge = pgalloc(8 * 1024 * 1024);
+    assert_true(NULL != huge);
+    huge[8 * 1024 * 1024 - 1] = 'z';
+    pgfree(huge);
+}
+
+// When a block is resized within its usable size the same pointer should be returned, otherwise its data should move intact.
+static void test_realloc_growth(void **state)
+{
+    char *ptr = pgalloc(20);
+    assert_true(NULL != ptr);
+
+    size_t usable = pgusable_size(ptr);
+    assert_true(usable >= 20);
+    assert_true(usable == PgBlockSize(PgPageInfo(ptr)));
+    assert_true(0 == pgusable_size(NULL));
+
+    memset(ptr, 'a', usable);
+    assert_true(ptr == pgrealloc(ptr, usable));
+    assert_true(ptr == pgrealloc(ptr, 1));
+
+    char *grown = pgrealloc(ptr, 3000);
+    assert_true(NULL != grown);
+    assert_true(pgusable_size(grown) >= 3000);
+    for (size_t i = 0; i < usable; i++) {
+        assert_true('a' == grown[i]);
+    }
+
+    // grow into a large span and back down into a page
+    memset(grown, 'b', 3000);
+    char *big = pgrealloc(grown, 100 * 1000);
+    assert_true(NULL != big);
+    assert_true(big == pgrealloc(big, 100 * 1000 + 1));
+    for (size_t i = 0; i < 3000; i++) {
+        assert_true('b' == big[i]);
+    }
+
+    char *small = pgrealloc(big, 100);
+    assert_true(NULL != small);
+    assert_true(pgusable_size(small) < 8192);
+    for (size_t i = 0; i < 100; i++) {
+        assert_true('b' == small[i]);
+    }
+
+    assert_true(NULL == pgrealloc(small, 0));
+
+    char *fresh = pgrealloc(NULL, 10);
+    assert_true(NULL != fresh);
+    pgfree(fresh);
+}
+
+// When zeroed blocks are requested they should be zero whether they are recycled or come from fresh pages.
+static void test_calloc_zeroes(void **state)
+{
+    const size_t sizes[] = { 24, 600, 5000, 100 * 1000 };
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        unsigned char *dirty = pgalloc(sizes[i]);
+        assert_true(NULL != dirty);
+        memset(dirty, 0xff, sizes[i]);
+        pgfree(dirty);
+
+        // the first is likely the block just freed, the rest come fresh from the page
+        unsigned char *blocks[4];
+
+        for (unsigned int j = 0; j < 4; j++) {
+            blocks[j] = pgcalloc(1, sizes[i]);
+            assert_true(NULL != blocks[j]);
+            for (size_t k = 0; k < sizes[i]; k++) {
+                assert_true(0 == blocks[j][k]);
+            }
+            memset(blocks[j], 0xff, sizes[i]);
+        }
+
+        for (unsigned int j = 0; j < 4; j++) {
+            pgfree(blocks[j]);
+        }
+    }
+
+    assert_true(NULL == pgcalloc(SIZE_MAX / 2, 3));
+}
+
+// When blocks of any size are requested they should be aligned on 16 bytes or on the largest power of 2 that fits the request.
+static void test_natural_alignment(void **state)
+{
+    for (size_t bytes = 1; bytes <= 8 * 1024 + 64; bytes++) {
+        void *ptr = pgalloc(bytes);
+        assert_true(NULL != ptr);
+
+        size_t align = 16;
+        while (align > bytes) {
+            align /= 2;
+        }
+
+        assert_true(0 == ((uintptr_t)ptr % align));
+        pgfree(ptr);
+    }
+}
+
+// When aligned blocks are requested they should honour the alignment for small and large requests alike.
+static void test_alloc_aligned(void **state)
+{
+    const size_t sizes[] = { 1, 24, 100, 1000, 5000, 8128, 100 * 1000 };
+
+    for (size_t align = 8; align <= MIB; align *= 2) {
+        for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            char *ptr = pgalloc_aligned(align, sizes[i]);
+            assert_true(NULL != ptr);
+            assert_true(0 == ((uintptr_t)ptr % align));
+            assert_true(pgusable_size(ptr) >= sizes[i]);
+
+            memset(ptr, 'a', sizes[i]);
+            pgfree(ptr);
+        }
+    }
+
+    // cache line aligned blocks should never share a line with their neighbours
+    char *first = pgalloc_aligned(64, 40);
+    char *second = pgalloc_aligned(64, 40);
+    assert_true(pgusable_size(first) % 64 == 0);
+    assert_true(first != second);
+    pgfree(first);
+    pgfree(second);
+
+    assert_true(NULL == pgalloc_aligned(0, 16));
+    assert_true(NULL == pgalloc_aligned(24, 16));
+    assert_true(NULL == pgalloc_aligned(2 * MIB, 16));
+}
+
+// When pointers from pgalloc and from other allocators are checked only those from pgalloc should be claimed.
+static void test_owns_pointers(void **state)
+{
+    int local = 0;
+    char *small = pgalloc(100);
+    char *large = pgalloc(100 * 1000);
+    char *aligned = pgalloc_aligned(MIB, 100);
+    char *other = malloc(100);
+
+    assert_true(pgowns(small));
+    assert_true(pgowns(large));
+    assert_true(pgowns(aligned));
+    assert_false(pgowns(large + 64));
+    assert_false(pgowns(other));
+    assert_false(pgowns(&local));
+    assert_false(pgowns(NULL));
+
+    pgfree(large);
+    pgtrim();
+    assert_false(pgowns(large));
+
+    pgfree(small);
+    pgfree(aligned);
+    free(other);
+}
+
+// When blocks are allocated and freed the statistics should account for every one of them.
+static void test_stats(void **state)
+{
+    static PgStats before;
+    static PgStats after;
+    void *blocks[STATS_BLOCKS];
+
+    pgstats(&before);
+    assert_true(before.classes > 0 && before.classes <= PG_STATS_CLASSES);
+
+    for (unsigned int i = 0; i < STATS_BLOCKS; i++) {
+        blocks[i] = pgalloc(STATS_SIZE);
+        assert_true(NULL != blocks[i]);
+    }
+    for (unsigned int i = 0; i < STATS_BLOCKS / 2; i++) {
+        pgfree(blocks[i]);
+    }
+    void *large = pgalloc(100 * 1000);
+
+    pgstats(&after);
+
+    unsigned int c = 0;
+    while (after.sizeClass[c].blockSize < STATS_SIZE) {
+        c++;
+    }
+
+    PgClassStats *b = &before.sizeClass[c];
+    PgClassStats *a = &after.sizeClass[c];
+
+    assert_true(a->blockSize == PgBlockSize(PgPageInfo(blocks[STATS_BLOCKS - 1])));
+    assert_true(a->allocs - b->allocs == STATS_BLOCKS);
+    assert_true(a->frees - b->frees >= STATS_BLOCKS / 2);
+    assert_true(a->usedBlocks >= STATS_BLOCKS / 2);
+    assert_true(a->requestedBytes - b->requestedBytes == (uint64_t)STATS_BLOCKS * STATS_SIZE);
+    assert_true(a->allocatedBytes - b->allocatedBytes == (uint64_t)STATS_BLOCKS * a->blockSize);
+    assert_true(a->newPages > b->newPages);
+    assert_true(a->pages >= 1);
+    assert_true(a->reservedBytes >= a->usedBlocks * a->blockSize);
+    assert_true(after.largeAllocs - before.largeAllocs == 1);
+    assert_true(after.largeSpans == before.largeSpans + 1);
+
+    for (unsigned int i = STATS_BLOCKS / 2; i < STATS_BLOCKS; i++) {
+        pgfree(blocks[i]);
+    }
+    pgfree(large);
+
+    pgstats(&after);
+    assert_true(after.sizeClass[c].usedBlocks == b->usedBlocks);
+    assert_true(after.largeFrees - before.largeFrees == 1);
+}
+
+static int countPages(const PgWalkPage *info, void *ctx)
+{
+    size_t *counts = (size_t *)ctx;
+
+    if (!info->large && info->blockSize == counts[0]) {
+        counts[1]++;
+        counts[2] += info->usedBlocks;
+        assert_true(info->usedBlocks <= info->maxBlocks);
+        assert_true(info->freeBlocks <= info->maxBlocks - info->usedBlocks);
+        assert_true(info->spanBytes >= info->maxBlocks * info->blockSize + info->tailBytes);
+    }
+
+    return 0;
+}
+
+static int stopWalk(const PgWalkPage *info, void *ctx)
+{
+    return 1;
+}
+
+// When pages are walked every page of the thread should be visited and the fragmentation report should agree.
+static void test_walk_fragmentation(void **state)
+{
+    static PgFragStats frag;
+    void *blocks[FRAG_BLOCKS];
+
+    for (unsigned int i = 0; i < FRAG_BLOCKS; i++) {
+        blocks[i] = pgalloc(FRAG_SIZE);
+        assert_true(NULL != blocks[i]);
+    }
+    // leave every page partially used
+    for (unsigned int i = 0; i < FRAG_BLOCKS; i += 2) {
+        pgfree(blocks[i]);
+    }
+
+    size_t counts[3] = { PgBlockSize(PgPageInfo(blocks[1])), 0, 0 };
+
+    assert_true(pgwalk(countPages, counts) >= counts[1]);
+    assert_true(counts[1] > 1);
+    assert_true(counts[2] >= FRAG_BLOCKS / 2);
+    assert_true(1 == pgwalk(stopWalk, NULL));
+
+    pgfrag(&frag);
+
+    unsigned int c = 0;
+    while (frag.sizeClass[c].blockSize != counts[0]) {
+        c++;
+    }
+
+    PgFragClass *fc = &frag.sizeClass[c];
+    size_t pages = 0;
+    for (unsigned int i = 0; i < PG_FRAG_BUCKETS; i++) {
+        pages += fc->utilization[i];
+    }
+
+    size_t perPage = PgMaxBlocks(PgPageInfo(blocks[1]));
+
+    assert_true(fc->pages == counts[1]);
+    assert_true(pages == fc->pages);
+    assert_true(fc->usedBlocks == counts[2]);
+    assert_true(fc->reclaimablePages == fc->pages - ((fc->usedBlocks + perPage - 1) / perPage));
+    assert_true(fc->reclaimablePages > 0);
+    assert_true(fc->freeBytes >= (FRAG_BLOCKS / 2) * fc->blockSize);
+
+    for (unsigned int i = 1; i < FRAG_BLOCKS; i += 2) {
+        pgfree(blocks[i]);
+    }
+}
+
+// When blocks are allocated and freed in bulk they should behave like as many single calls.
+static void test_bulk(void **state)
+{
+    static PgStats before;
+    static PgStats after;
+    void *blocks[BULK_BLOCKS + 2];
+
+    pgstats(&before);
+
+    assert_true(BULK_BLOCKS == pgalloc_bulk(BULK_SIZE, BULK_BLOCKS, blocks));
+    for (unsigned int i = 0; i < BULK_BLOCKS; i++) {
+        assert_true(0 == ((uintptr_t)blocks[i] % 16));
+        assert_true(pgusable_size(blocks[i]) >= BULK_SIZE);
+        memset(blocks[i], 0, BULK_SIZE);
+        *((unsigned int *)blocks[i]) = i;
+    }
+    // no block is handed out twice
+    for (unsigned int i = 0; i < BULK_BLOCKS; i++) {
+        assert_true(i == *((unsigned int *)blocks[i]));
+    }
+
+    pgstats(&after);
+
+    unsigned int c = 0;
+    while (after.sizeClass[c].blockSize < BULK_SIZE) {
+        c++;
+    }
+
+    assert_true(after.sizeClass[c].allocs - before.sizeClass[c].allocs == BULK_BLOCKS);
+    assert_true(after.sizeClass[c].usedBlocks - before.sizeClass[c].usedBlocks == BULK_BLOCKS);
+
+    // every other block, so every page is left partially used
+    void *odd[BULK_BLOCKS / 2];
+    for (unsigned int i = 0; i < BULK_BLOCKS / 2; i++) {
+        odd[i] = blocks[(2 * i) + 1];
+    }
+    pgfree_bulk(odd, BULK_BLOCKS / 2);
+
+    PageHeader *ph = PgPageInfo(blocks[0]);
+    assert_true(PgUsedBlocks(ph) < PgMaxBlocks(ph));
+
+    // freed blocks are reused before new pages are taken
+    uint64_t newPages = after.sizeClass[c].newPages;
+    assert_true(BULK_BLOCKS / 2 == pgalloc_bulk(BULK_SIZE, BULK_BLOCKS / 2, odd));
+    for (unsigned int i = 0; i < BULK_BLOCKS / 2; i++) {
+        blocks[(2 * i) + 1] = odd[i];
+    }
+    pgstats(&after);
+    assert_true(after.sizeClass[c].newPages == newPages);
+
+    blocks[BULK_BLOCKS] = NULL;
+    blocks[BULK_BLOCKS + 1] = pgalloc(100 * 1000);
+    pgfree_bulk(blocks, BULK_BLOCKS + 2);
+
+    pgstats(&after);
+    assert_true(after.sizeClass[c].usedBlocks == before.sizeClass[c].usedBlocks);
+    assert_true(after.sizeClass[c].frees - before.sizeClass[c].frees == 3 * BULK_BLOCKS / 2);
+    assert_true(after.largeSpans == before.largeSpans);
+}
+
+static int countArenaSpans(const PgWalkPage *info, void *ctx)
+{
+    size_t *counts = (size_t *)ctx;
+
+    if (info->arena) {
+        counts[0]++;
+        counts[1] += info->spanBytes;
+    }
+
+    return 0;
+}
+
+// When an arena is reset every block should be freed at once and the arena should start over.
+static void test_arena(void **state)
+{
+    static PgStats before;
+    static PgStats after;
+    unsigned int *blocks[ARENA_BLOCKS];
+
+    PgArena *arena = pgarena_create();
+    assert_true(NULL != arena);
+
+    pgstats(&before);
+
+    for (unsigned int round = 0; round < 2; round++) {
+        for (unsigned int i = 0; i < ARENA_BLOCKS; i++) {
+            blocks[i] = pgarena_alloc(arena, ARENA_SIZE);
+            assert_true(NULL != blocks[i]);
+            assert_true(0 == ((uintptr_t)blocks[i] % 16));
+            *blocks[i] = i;
+        }
+        for (unsigned int i = 0; i < ARENA_BLOCKS; i++) {
+            assert_true(i == *blocks[i]);
+        }
+
+        // a span of its own and a large span
+        char *direct = pgarena_alloc(arena, 100 * 1000);
+        char *large = pgarena_alloc(arena, 4 * MIB);
+        assert_true(NULL != direct && NULL != large);
+        memset(direct, 1, 100 * 1000);
+        memset(large, 1, 4 * MIB);
+        assert_true(0 == ((uintptr_t)large % 16));
+
+        pgstats(&after);
+        assert_true(after.largeSpans == before.largeSpans + 1);
+
+        // every span is walked, the one of its own included
+        size_t counts[2] = { 0, 0 };
+        pgwalk(countArenaSpans, counts);
+        assert_true(counts[0] >= 3 && counts[1] >= ARENA_BLOCKS * ARENA_SIZE + 100 * 1000);
+
+        void *first = blocks[0];
+        pgarena_reset(arena);
+
+        pgstats(&after);
+        assert_true(after.largeSpans == before.largeSpans);
+        counts[0] = counts[1] = 0;
+        pgwalk(countArenaSpans, counts);
+        assert_true(1 == counts[0]);
+        assert_true(first == pgarena_alloc(arena, ARENA_SIZE));
+        pgarena_reset(arena);
+    }
+
+    pgarena_destroy(arena);
+    pgarena_destroy(NULL);
+}
+
+typedef struct CacheObject CacheObject;
+struct CacheObject {
+    unsigned int magic;     // set by the constructor only
+    unsigned int value;
+    char pad[92];
+};
+
+static unsigned int constructed = 0;
+static unsigned int destroyed = 0;
+
+static void constructObject(void *obj)
+{
+    ((CacheObject *)obj)->magic = CACHE_MAGIC;
+    constructed++;
+}
+
+static void destroyObject(void *obj)
+{
+    assert_true(CACHE_MAGIC == ((CacheObject *)obj)->magic);
+    destroyed++;
+}
+
+static int countCachePages(const PgWalkPage *info, void *ctx)
+{
+    size_t *counts = (size_t *)ctx;
+
+    if (info->cache) {
+        counts[0]++;
+        counts[1] += info->usedBlocks;
+    }
+
+    return 0;
+}
+
+// When objects come from a cache they should be constructed once, keep their state across frees and live on pages of their own.
+static void test_cache(void **state)
+{
+    CacheObject *objects[CACHE_OBJECTS];
+
+    PgCache *cache = pgcache_create(sizeof(CacheObject), 64, constructObject, destroyObject);
+    assert_true(NULL != cache);
+    assert_true(NULL == pgcache_create(sizeof(CacheObject), 48, NULL, NULL));
+
+    assert_true(pgcache_reserve(cache, CACHE_OBJECTS));
+    assert_true(0 == constructed);
+
+    void *other = pgalloc(sizeof(CacheObject));
+
+    for (unsigned int round = 0; round < 2; round++) {
+        for (unsigned int i = 0; i < CACHE_OBJECTS; i++) {
+            objects[i] = pgcache_alloc(cache);
+            assert_true(NULL != objects[i]);
+            assert_true(0 == ((uintptr_t)objects[i] % 64));
+            assert_true(CACHE_MAGIC == objects[i]->magic);
+            assert_true(PgPageInfo(objects[i]) != PgPageInfo(other));
+            objects[i]->value = i;
+        }
+        unsigned int perPage = PgMaxBlocks(PgPageInfo(objects[0]));
+
+        for (unsigned int i = 0; i < CACHE_OBJECTS; i++) {
+            pgcache_free(cache, objects[i]);
+        }
+
+        // the second round reuses constructed objects and may only construct the few the reserved pages still had
+        assert_true(constructed >= CACHE_OBJECTS && constructed < CACHE_OBJECTS + perPage);
+    }
+
+    // the pages of a cache are walked like any other, and pgfree() hands an object back to its cache
+    size_t counts[2] = { 0, 0 };
+    CacheObject *obj = pgcache_alloc(cache);
+
+    pgwalk(countCachePages, counts);
+    assert_true(counts[0] >= 1 && 1 == counts[1]);
+
+    pgfree(obj);
+    counts[0] = counts[1] = 0;
+    pgwalk(countCachePages, counts);
+    assert_true(counts[0] >= 1 && 0 == counts[1]);
+
+    pgfree(other);
+    pgcache_destroy(cache);
+    pgcache_destroy(NULL);
+    assert_true(constructed == destroyed);
+}
+
+typedef struct FileNode {
+    struct FileNode *next;
+    unsigned int value;
+    char data[100];
+} FileNode;
+
+// When a file heap is closed and opened again its blocks should be found where they were left through its root.
+static void test_file_heap(void **state)
+{
+    remove(FILE_PATH);
+    assert_true(NULL == pgfile_open(FILE_PATH, (char *)FILE_BASE + 4096, FILE_SIZE));
+
+    PgFile *file = pgfile_open(FILE_PATH, FILE_BASE, FILE_SIZE);
+    assert_true(NULL != file);
+    assert_true(NULL == pgfile_open(FILE_PATH, FILE_BASE, FILE_SIZE));
+    assert_true(NULL == pgfile_root(file));
+    assert_true(NULL == pgfile_alloc(file, 64 * 1024));
+
+    FileNode *head = NULL;
+
+    for (unsigned int i = 0; i < FILE_NODES; i++) {
+        FileNode *node = pgfile_alloc(file, sizeof(FileNode));
+        assert_true(NULL != node);
+        assert_true((uintptr_t)node >= (uintptr_t)FILE_BASE && (uintptr_t)node < (uintptr_t)FILE_BASE + FILE_SIZE);
+        assert_true(pgowns(node));
+        node->value = i;
+        node->next = head;
+        head = node;
+    }
+    pgfile_set_root(file, head);
+
+    // drop the two newest nodes, one through the file and one the way any block is freed
+    FileNode *second = head->next;
+    pgfile_set_root(file, second->next);
+    pgfile_free(file, head);
+    pgfree(second);
+
+    assert_true(pgfile_sync(file));
+    pgfile_close(file);
+    pgfile_close(NULL);
+    assert_false(pgowns(second));
+
+    assert_true(NULL == pgfile_open(FILE_PATH, FILE_BASE, 2 * FILE_SIZE));
+
+    file = pgfile_open(FILE_PATH, FILE_BASE, FILE_SIZE);
+    assert_true(NULL != file);
+
+    unsigned int expected = FILE_NODES - 2;
+
+    for (FileNode *node = pgfile_root(file); node; node = node->next) {
+        assert_true(--expected == node->value);
+    }
+    assert_true(0 == expected);
+
+    // the two freed blocks are handed out again before any new one
+    FileNode *again = pgfile_alloc(file, sizeof(FileNode));
+    assert_true(again == head || again == second);
+    pgfile_free(file, again);
+
+    FileNode *node = pgfile_root(file);
+    while (node) {
+        FileNode *next = node->next;
+        pgfile_free(file, node);
+        node = next;
+    }
+    pgfile_set_root(file, NULL);
+
+    pgfile_close(file);
+    remove(FILE_PATH);
+}
+
+// When calls are traced each should leave a record that ties the free of a block to its allocation.
+static void test_trace(void **state)
+{
+#ifdef PG_TRACE
+    static PgTraceRecord records[8];
+    static const uint32_t ops[] = { PG_TRACE_ALLOC, PG_TRACE_ALLOC, PG_TRACE_FREE, PG_TRACE_ALLOC, PG_TRACE_FREE, PG_TRACE_FREE };
+
+    assert_true(pgtrace(TRACE_PATH));
+
+    void *first = pgalloc(100);
+    void *second = pgcalloc(4, 50);
+    // resized in place, which a replay sees as a free and an allocation of the same block
+    assert_true(first == pgrealloc(first, 10));
+    pgfree(second);
+    pgfree(first);
+    pgfree(NULL);
+
+    assert_true(pgtrace(NULL));
+    pgfree(pgalloc(100));
+
+    FILE *file = fopen(TRACE_PATH, "rb");
+    assert_true(NULL != file);
+    size_t num = fread(records, sizeof(PgTraceRecord), 8, file);
+    fclose(file);
+    remove(TRACE_PATH);
+
+    const uint64_t ptrs[] = { (uintptr_t)first, (uintptr_t)second, (uintptr_t)first, (uintptr_t)first, (uintptr_t)second, (uintptr_t)first };
+    const uint64_t sizes[] = { 100, 200, 0, 10, 0, 0 };
+
+    assert_true(6 == num);
+    for (unsigned int i = 0; i < num; i++) {
+        assert_true(ops[i] == records[i].op && ptrs[i] == records[i].ptr && sizes[i] == records[i].size);
+        assert_true(0 != records[i].thread && records[0].thread == records[i].thread);
+        assert_true(i == 0 || records[i - 1].time <= records[i].time);
+    }
+#else
+    assert_false(pgtrace(TRACE_PATH));
+#endif
+}
+
+/*
+ * Read the profile at PROFILE_PATH and return the number of samples it lists with PROFILE_SIZE bytes each.
+ */
+static size_t readProfile(size_t *objects, size_t *bytes, size_t *rate)
+{
+    static char line[1024];
+    char prefix[64];
+    size_t samples = 0;
+    int mapped = 0;
+    FILE *file = fopen(PROFILE_PATH, "r");
+
+    snprintf(prefix, sizeof(prefix), "1: %d [0: 0] @ 0x", PROFILE_SIZE);
+
+    assert_true(NULL != file);
+    assert_true(NULL != fgets(line, sizeof(line), file));
+    assert_true(3 == sscanf(line, "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu", objects, bytes, rate));
+
+    while (fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, prefix, strlen(prefix))) {
+            samples++;
+        }
+        mapped |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+    }
+
+    fclose(file);
+    remove(PROFILE_PATH);
+    assert_true(mapped);
+
+    return samples;
+}
+
+// When every allocation is sampled, pgprofile_dump() should list the blocks still live and none that were freed.
+static void test_profile(void **state)
+{
+    void *blocks[PROFILE_BLOCKS];
+    size_t objects = 0;
+    size_t bytes = 0;
+    size_t rate = 0;
+
+    // an average of 1 byte between samples samples every request of more than a few dozen bytes
+    assert_true(0 == pgprofile(1));
+
+    for (unsigned int i = 0; i < PROFILE_BLOCKS; i++) {
+        // a constant size, so the inline path has to hand sampled requests to the library
+        blocks[i] = pgalloc(PROFILE_SIZE);
+        assert_true(NULL != blocks[i]);
+        memset(blocks[i], 0xff, PROFILE_SIZE);
+    }
+
+    for (unsigned int i = 0; i < PROFILE_BLOCKS; i += 2) {
+        pgfree(blocks[i]);
+    }
+
+    assert_true(pgprofile_dump(PROFILE_PATH));
+    assert_true((PROFILE_BLOCKS / 2) == readProfile(&objects, &bytes, &rate));
+    assert_true((PROFILE_BLOCKS / 2) == objects && (PROFILE_BLOCKS / 2) * PROFILE_SIZE == bytes && 1 == rate);
+
+    assert_true(1 == pgprofile(0));
+
+    // not sampled, so it comes from a page of its size class
+    void *block = pgalloc(PROFILE_SIZE);
+    assert_true(pgusable_size(block) < 2 * PROFILE_SIZE);
+    pgfree(block);
+
+    for (unsigned int i = 1; i < PROFILE_BLOCKS; i += 2) {
+        pgfree(blocks[i]);
+    }
+
+    assert_true(pgprofile_dump(PROFILE_PATH));
+    assert_true(0 == readProfile(&objects, &bytes, &rate));
+    assert_true(0 == objects && 0 == bytes && 1 == rate);
+}
+
+#ifdef PG_BITMAP_PAGES
+static jmp_buf abortJump;
+
+static void catchAbort(int sig)
+{
+    (void)sig;
+    longjmp(abortJump, 1);
+}
+
+// When blocks of a bitmap page are freed they should be reused in address order and freeing one twice should abort.
+static void test_bitmap_pages(void **state)
+{
+    void *blocks[LEN];
+
+    for (unsigned int i = 0; i < LEN; i++) {
+        blocks[i] = pgalloc(BITMAP_SIZE);
+        assert_true(NULL != blocks[i]);
+        // blocks are handed out down from the end of the span
+        assert_true(i == 0 || (uintptr_t)blocks[i] < (uintptr_t)blocks[i - 1]);
+    }
+
+    PageHeader *ph = PgPageInfo(blocks[0]);
+    assert_true(ph == PgPageInfo(blocks[LEN - 1]));
+
+    // free every other block, neither in address order nor in reverse
+    for (unsigned int i = 0; i < LEN; i += 4) {
+        pgfree(blocks[i + 2]);
+    }
+    for (unsigned int i = 0; i < LEN; i += 4) {
+        pgfree(blocks[i]);
+    }
+    assert_true((LEN / 2) == PgFreeBlocks(ph));
+
+    for (unsigned int i = 0; i < LEN; i += 2) {
+        void *block = pgalloc(BITMAP_SIZE);
+        assert_true(blocks[i] == block);
+    }
+    assert_true(0 == PgFreeBlocks(ph));
+
+    void (*previous)(int) = signal(SIGABRT, catchAbort);
+    volatile int aborted = 0;
+
+    pgfree(blocks[1]);
+    if (!setjmp(abortJump)) {
+        pgfree(blocks[1]);
+    } else {
+        aborted = 1;
+    }
+    signal(SIGABRT, previous);
+    assert_true(aborted);
+
+    for (unsigned int i = 0; i < LEN; i++) {
+        if (i != 1) {
+            pgfree(blocks[i]);
+        }
+    }
+}
+#endif
+
+#ifdef PG_HEADER_TABLE
+// When page headers are kept in the table of their chunk a whole page should be left to blocks.
+static void test_header_table(void **state)
+{
+    void *first = pgalloc(PAGE_DATA);
+    void *second = pgalloc(PAGE_DATA);
+    assert_true(NULL != first && NULL != second);
+
+    // a block of the largest class takes its single page from its first byte
+    assert_true(0 == ((uintptr_t)first % 8192) && 0 == ((uintptr_t)second % 8192));
+    assert_true(PAGE_DATA == pgusable_size(first));
+
+    // each header lies at the head of the 2 MiB chunk holding its page
+    PageHeader *ph1 = PgPageInfo(first);
+    PageHeader *ph2 = PgPageInfo(second);
+    assert_true(((uintptr_t)ph1 >> 21) == ((uintptr_t)first >> 21) && (uintptr_t)ph1 < (uintptr_t)first);
+    assert_true(((uintptr_t)ph2 >> 21) == ((uintptr_t)second >> 21) && (uintptr_t)ph2 < (uintptr_t)second);
+    assert_true(1 == PgUsedBlocks(ph1) && 1 == PgMaxBlocks(ph1));
+
+    // so the headers of neighbouring pages share a page instead of a cache set
+    if (((uintptr_t)first >> 21) == ((uintptr_t)second >> 21)) {
+        assert_true(((uintptr_t)ph1 > (uintptr_t)ph2 ? (uintptr_t)ph1 - (uintptr_t)ph2 : (uintptr_t)ph2 - (uintptr_t)ph1) < 8192);
+    }
+
+    pgfree(first);
+    pgfree(second);
+}
+#endif
+
+// When a request size is known at compile time the inline size class should match the library's for every size.
+static void test_inline_size_classes(void **state)
+{
+    static PgStats stats;
+
+    pgstats(&stats);
+    assert_true(PG_SIZE_CLASSES == stats.classes);
+
+    // PG_BITMAP_PAGES builds have a longer PageHeader and a smaller last class
+    for (size_t bytes = 0; bytes <= stats.sizeClass[PG_SIZE_CLASSES - 1].blockSize; bytes++) {
+        unsigned int c = PG_SIZE_CLASS(bytes);
+
+        assert_true(stats.sizeClass[c].blockSize >= bytes);
+        assert_true(c == 0 || stats.sizeClass[c - 1].blockSize < bytes);
+    }
+
+    // constant sizes take the inline path until their page runs out
+    void *blocks[LEN];
+    for (unsigned int i = 0; i < LEN; i++) {
+        blocks[i] = pgalloc(24);
+        assert_true(PgBlockSize(PgPageInfo(blocks[i])) == stats.sizeClass[PG_SIZE_CLASS(24)].blockSize);
+        assert_true(0 == ((uintptr_t)blocks[i] % 16));
+    }
+    for (unsigned int i = 0; i < LEN; i++) {
+        pgfree(blocks[i]);
+    }
+}
+
 // When data is stored it is able to be retreaved.
 static void test_basic_int_array(void **state)
 {
@@ -264,6 +1237,458 @@ static void test_basic_int_array(void **state)
     pgfree(big);
 }
 
+static void *worker_churn(void *arg)
+{
+    Worker *w = arg;
+    unsigned int **blocks = pgalloc(sizeof(*blocks) * THREAD_BLOCKS);
+
+    w->ok = (blocks != NULL);
+
+    for (int round = 0; round < THREAD_ROUNDS && w->ok; round++) {
+        for (unsigned int i = 0; i < THREAD_BLOCKS; i++) {
+            unsigned int words = 1 + (i % 32);
+
+            blocks[i] = pgalloc(sizeof(**blocks) * words);
+            if (!blocks[i]) {
+                w->ok = 0;
+                return NULL;
+            }
+
+            for (unsigned int j = 0; j < words; j++) {
+                blocks[i][j] = w->id ^ i;
+            }
+        }
+
+        for (unsigned int i = 0; i < THREAD_BLOCKS; i++) {
+            unsigned int words = 1 + (i % 32);
+
+            for (unsigned int j = 0; j < words; j++) {
+                if (blocks[i][j] != (w->id ^ i)) {
+                    w->ok = 0;
+                }
+            }
+            pgfree(blocks[i]);
+        }
+    }
+
+    for (int i = 0; i < LEN; i++) {
+        w->kept[i] = pgalloc(sizeof(*(w->kept[i])));
+        if (!w->kept[i]) {
+            w->ok = 0;
+            break;
+        }
+        *(w->kept[i]) = w->id;
+    }
+
+    pgfree(blocks);
+
+    return NULL;
+}
+
+static void *worker_single(void *arg)
+{
+    Node **n = arg;
+
+    *n = NewNode();
+
+    return NULL;
+}
+
+static void *worker_free_all(void *arg)
+{
+    void **blocks = arg;
+
+    for (int i = 0; i < LEN / 2; i++) {
+        pgfree(blocks[i]);
+    }
+
+    return NULL;
+}
+
+static void *worker_free_bulk(void *arg)
+{
+    pgfree_bulk(arg, LEN / 2);
+
+    return NULL;
+}
+
+static int countNodePages(const PgWalkPage *info, void *ctx)
+{
+    size_t *counts = (size_t *)ctx;
+
+    if (!info->large && !info->pool && info->usedBlocks) {
+        counts[info->node == 1 ? 1 : 0]++;
+    }
+
+    return 0;
+}
+
+static void *worker_pack(void *arg)
+{
+    PageHeader **pages = arg;
+    void *blocks[PACK_PAGES][16];
+
+    // a new thread has no page of its own yet, so every page below is filled from its first block
+    void *first = pgalloc(PACK_SIZE);
+    unsigned int perPage = PgMaxBlocks(PgPageInfo(first));
+    pgfree(first);
+
+    for (unsigned int p = 0; p < PACK_PAGES; p++) {
+        for (unsigned int i = 0; i < perPage; i++) {
+            blocks[p][i] = pgalloc(PACK_SIZE);
+        }
+        pages[p] = PgPageInfo(blocks[p][0]);
+    }
+
+    // the nearly empty page gets its blocks back last, the nearly full one first
+    pgfree(blocks[1][0]);
+    for (unsigned int i = 0; i < perPage / 2; i++) {
+        pgfree(blocks[2][i]);
+    }
+    for (unsigned int i = 0; i < perPage - 1; i++) {
+        pgfree(blocks[0][i]);
+    }
+
+    blocks[1][0] = pgalloc(PACK_SIZE);
+    pages[PACK_PAGES] = PgPageInfo(blocks[1][0]);
+    blocks[2][0] = pgalloc(PACK_SIZE);
+    pages[PACK_PAGES + 1] = PgPageInfo(blocks[2][0]);
+
+    for (unsigned int i = 1; i < perPage / 2; i++) {
+        blocks[2][i] = pgalloc(PACK_SIZE);
+    }
+    for (unsigned int p = 1; p < PACK_PAGES; p++) {
+        for (unsigned int i = 0; i < perPage; i++) {
+            pgfree(blocks[p][i]);
+        }
+    }
+    pgfree(blocks[0][perPage - 1]);
+
+    return NULL;
+}
+
+static void *worker_node(void *arg)
+{
+    static PgStats stats;
+    size_t *counts = arg;
+    void *blocks[NODE_BLOCKS];
+
+    pgnode(1);
+    pgstats(&stats);
+    counts[4] = stats.node[0].usedPages;
+    counts[5] = stats.node[1].usedPages;
+
+    for (unsigned int i = 0; i < NODE_BLOCKS; i++) {
+        blocks[i] = pgalloc(NODE_SIZE);
+    }
+
+    pgwalk(countNodePages, counts);
+    pgstats(&stats);
+    counts[2] = stats.nodes;
+    counts[3] = stats.node[1].usedPages - counts[5];
+    counts[4] = stats.node[0].usedPages > counts[4];
+
+    for (unsigned int i = 0; i < NODE_BLOCKS; i++) {
+        pgfree(blocks[i]);
+    }
+    pgnode(-1);
+
+    return NULL;
+}
+
+static void *worker_produce(void *arg)
+{
+    Queue *q = arg;
+
+    for (unsigned int i = 0; i < QUEUE_ITEMS; i++) {
+        unsigned int *p = pgalloc(sizeof(*p) * (1 + (i % 16)));
+        if (!p) {
+            q->ok = 0;
+            break;
+        }
+        *p = i;
+
+        pthread_mutex_lock(&q->lock);
+        while (q->tail - q->head == QUEUE_LEN) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        q->items[q->tail % QUEUE_LEN] = p;
+        q->tail++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+static void *worker_consume(void *arg)
+{
+    Queue *q = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->tail == q->head && !q->done) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->tail == q->head) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        unsigned int *p = q->items[q->head % QUEUE_LEN];
+        q->head++;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        if (*p >= QUEUE_ITEMS) {
+            q->ok = 0;
+        }
+        pgfree(p);
+    }
+
+    return NULL;
+}
+
+// When many threads allocate and free concurrently each thread should use its own pages and keep its data intact.
+static void test_threads_private_pages(void **state)
+{
+    Worker workers[THREADS] = { 0 };
+
+    for (unsigned int i = 0; i < THREADS; i++) {
+        workers[i].id = i + 1;
+        assert_true(0 == pthread_create(&workers[i].thread, NULL, worker_churn, &workers[i]));
+    }
+
+    for (unsigned int i = 0; i < THREADS; i++) {
+        assert_true(0 == pthread_join(workers[i].thread, NULL));
+        assert_true(workers[i].ok);
+    }
+
+    for (unsigned int i = 0; i < THREADS; i++) {
+        for (unsigned int j = i + 1; j < THREADS; j++) {
+            assert_true(PgPageInfo(workers[i].kept[0]) != PgPageInfo(workers[j].kept[0]));
+        }
+    }
+
+    // blocks outliving their thread are freed through the shared pool
+    for (unsigned int i = 0; i < THREADS; i++) {
+        for (int j = 0; j < LEN; j++) {
+            assert_true(workers[i].id == *(workers[i].kept[j]));
+            pgfree(workers[i].kept[j]);
+        }
+    }
+}
+
+// When a thread exits its pages should be handed back and reused by other threads once empty.
+static void test_threads_reuse_pages(void **state)
+{
+    pthread_t thread;
+    Node *first = NULL;
+    Node *second = NULL;
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_single, &first));
+    assert_true(0 == pthread_join(thread, NULL));
+    assert_true(NULL != first);
+
+    PageHeader *ph = PgPageInfo(first);
+    assert_true(1 == PgUsedBlocks(ph));
+
+    // the page is reclaimed once a thread next needs a new page
+    pgfree(first);
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_single, &second));
+    assert_true(0 == pthread_join(thread, NULL));
+    assert_true(NULL != second);
+
+    assert_true(ph == PgPageInfo(second));
+    assert_true(1 == PgUsedBlocks(ph));
+
+    pgfree(second);
+}
+
+// When another thread frees blocks they should be reclaimed in bulk by the owning thread on its next allocation.
+static void test_threads_remote_free(void **state)
+{
+    pthread_t thread;
+    void *blocks[LEN / 2];
+
+    for (int i = 0; i < LEN / 2; i++) {
+        blocks[i] = pgalloc(REMOTE_SIZE);
+        assert_true(NULL != blocks[i]);
+    }
+
+    PageHeader *ph = PgPageInfo(blocks[0]);
+    assert_true(LEN / 2 == PgUsedBlocks(ph));
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_free_all, blocks));
+    assert_true(0 == pthread_join(thread, NULL));
+
+    // nothing is reclaimed until this thread allocates again
+    assert_true(LEN / 2 == PgUsedBlocks(ph));
+    assert_true(0 == PgFreeBlocks(ph));
+
+    void *again = pgalloc(REMOTE_SIZE);
+    assert_true(ph == PgPageInfo(again));
+    assert_true(1 == PgUsedBlocks(ph));
+    assert_true(LEN / 2 - 1 == PgFreeBlocks(ph));
+
+    pgfree(again);
+}
+
+// When another thread frees blocks in bulk they should be handed back to the owning thread together.
+static void test_threads_remote_free_bulk(void **state)
+{
+    pthread_t thread;
+    void *blocks[LEN / 2];
+
+    assert_true(LEN / 2 == pgalloc_bulk(REMOTE_SIZE, LEN / 2, blocks));
+
+    PageHeader *ph = PgPageInfo(blocks[0]);
+    unsigned int used = PgUsedBlocks(ph);
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_free_bulk, blocks));
+    assert_true(0 == pthread_join(thread, NULL));
+    assert_true(used == PgUsedBlocks(ph));
+
+    void *again = pgalloc(REMOTE_SIZE);
+    assert_true(ph == PgPageInfo(again));
+    assert_true(1 == PgUsedBlocks(ph));
+
+    pgfree(again);
+}
+
+// When a thread takes its pages from another NUMA node they should come from chunks of that node, even on a single node machine.
+static void test_threads_node_pools(void **state)
+{
+    static PgStats stats;
+    pthread_t thread;
+    size_t counts[6] = { 0 };
+
+    assert_true(0 == pgnode(PG_STATS_NODES));
+    assert_true(0 == pgnode(-2));
+
+    void *block = pgalloc(NODE_SIZE);
+    pgstats(&stats);
+    assert_true(stats.nodes >= 1 && stats.node[0].chunks >= 1 && stats.node[0].usedPages >= 1);
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_node, counts));
+    assert_true(0 == pthread_join(thread, NULL));
+
+    /*
+     * every page the worker filled came from node 1 and none from node 0. pgstats() counts every page, while pgwalk() may
+     * see none at all once every page is full and there is no full page list, as with PG_HEADER_TABLE and PG_NO_FULL_LIST.
+     */
+    assert_true(0 == counts[0] && 0 == counts[4]);
+    assert_true(counts[2] >= 2);
+    assert_true(counts[3] >= NODE_BLOCKS / (PAGE_DATA / NODE_SIZE) && counts[3] >= counts[1]);
+
+    // while this thread keeps filling its own page
+    void *again = pgalloc(NODE_SIZE);
+    assert_true(PgPageInfo(again) == PgPageInfo(block));
+
+    pgfree(again);
+    pgfree(block);
+}
+
+// When a page that filled up gets blocks back the fullest such page should be refilled first, leaving the emptiest to drain.
+static void test_threads_pack_pages(void **state)
+{
+    pthread_t thread;
+    PageHeader *pages[PACK_PAGES + 2];
+
+    assert_true(0 == pthread_create(&thread, NULL, worker_pack, pages));
+    assert_true(0 == pthread_join(thread, NULL));
+
+    assert_true(pages[1] == pages[PACK_PAGES]);
+    assert_true(pages[2] == pages[PACK_PAGES + 1]);
+}
+
+// When one thread allocates and others free concurrently every block should arrive intact.
+static void test_threads_producer_consumer(void **state)
+{
+    pthread_t producer;
+    pthread_t consumers[THREADS];
+    Queue q = { .head = 0, .tail = 0, .done = 0, .ok = 1 };
+
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    assert_true(0 == pthread_create(&producer, NULL, worker_produce, &q));
+    for (int i = 0; i < THREADS; i++) {
+        assert_true(0 == pthread_create(&consumers[i], NULL, worker_consume, &q));
+    }
+
+    assert_true(0 == pthread_join(producer, NULL));
+    for (int i = 0; i < THREADS; i++) {
+        assert_true(0 == pthread_join(consumers[i], NULL));
+    }
+
+    assert_true(q.ok);
+    assert_true(QUEUE_ITEMS == q.head);
+
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+}
+
+// When freed pages are trimmed the memory backing them should be returned to the OS.
+static void test_trim_returns_memory(void **state)
+{
+    char **blocks = pgalloc(sizeof(*blocks) * TRIM_BLOCKS);
+    assert_true(NULL != blocks);
+
+    // keep every free page until pgtrim()
+    pgdecay(60000, TRIM_BLOCKS * 4);
+
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        blocks[i] = pgalloc(TRIM_SIZE);
+        assert_true(NULL != blocks[i]);
+        memset(blocks[i], 1, TRIM_SIZE);
+    }
+
+    size_t peak = residentBytes();
+
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        pgfree(blocks[i]);
+    }
+
+    // only a few empty pages stay cached by this thread
+    assert_true(pgtrim() >= (size_t)(TRIM_BLOCKS - 8) * 8192);
+    assert_true(residentBytes() + (12 * MIB) <= peak);
+
+    pgdecay(10000, 2048);
+    pgfree(blocks);
+}
+
+// When no decay time is allowed freed pages should be returned to the OS without calling pgtrim().
+static void test_decay_returns_memory(void **state)
+{
+    char **blocks = pgalloc(sizeof(*blocks) * TRIM_BLOCKS);
+    assert_true(NULL != blocks);
+
+    pgdecay(0, 0);
+
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        blocks[i] = pgalloc(TRIM_SIZE);
+        assert_true(NULL != blocks[i]);
+        memset(blocks[i], 1, TRIM_SIZE);
+    }
+
+    size_t peak = residentBytes();
+
+    for (int i = 0; i < TRIM_BLOCKS; i++) {
+        pgfree(blocks[i]);
+    }
+
+    assert_true(residentBytes() + (12 * MIB) <= peak);
+
+    pgdecay(10000, 2048);
+    pgfree(blocks);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -275,7 +1700,39 @@ int main(void)
         cmocka_unit_test(test_max_block_per_page),
         cmocka_unit_test(test_greater_than_max_request_per_page),
         cmocka_unit_test(test_maximum_page_index),
+        cmocka_unit_test(test_size_classes),
+        cmocka_unit_test(test_multi_page_span),
+        cmocka_unit_test(test_large_span_cache),
+        cmocka_unit_test(test_realloc_growth),
+        cmocka_unit_test(test_calloc_zeroes),
+        cmocka_unit_test(test_natural_alignment),
+        cmocka_unit_test(test_alloc_aligned),
+        cmocka_unit_test(test_owns_pointers),
+        cmocka_unit_test(test_stats),
+        cmocka_unit_test(test_walk_fragmentation),
+        cmocka_unit_test(test_bulk),
+        cmocka_unit_test(test_arena),
+        cmocka_unit_test(test_cache),
+        cmocka_unit_test(test_file_heap),
+        cmocka_unit_test(test_trace),
+        cmocka_unit_test(test_profile),
+#ifdef PG_BITMAP_PAGES
+        cmocka_unit_test(test_bitmap_pages),
+#endif
+#ifdef PG_HEADER_TABLE
+        cmocka_unit_test(test_header_table),
+#endif
+        cmocka_unit_test(test_inline_size_classes),
         cmocka_unit_test(test_basic_int_array),
+        cmocka_unit_test(test_threads_private_pages),
+        cmocka_unit_test(test_threads_reuse_pages),
+        cmocka_unit_test(test_threads_remote_free),
+        cmocka_unit_test(test_threads_remote_free_bulk),
+        cmocka_unit_test(test_threads_producer_consumer),
+        cmocka_unit_test(test_threads_node_pools),
+        cmocka_unit_test(test_threads_pack_pages),
+        cmocka_unit_test(test_trim_returns_memory),
+        cmocka_unit_test(test_decay_returns_memory),
     };
 
     return cmocka_run_group_tests_name("pgalloc", tests, NULL, NULL);